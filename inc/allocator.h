@@ -0,0 +1,57 @@
+#ifndef GALA_ALLOCATOR_H
+#define GALA_ALLOCATOR_H
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include "types.h"
+#include "gpu.h"
+
+
+// resources of different kinds may not share a bufferImageGranularity page
+typedef enum {
+	MEMORY_FREE = 0,
+	MEMORY_LINEAR,  // buffers and linear images
+	MEMORY_OPTIMAL, // optimal tiling images
+} memory_kind;
+
+typedef struct {
+	VkDeviceMemory mem;
+	VkDeviceSize offset;
+	VkDeviceSize size;
+	void *mapped; // NULL unless the memory is host visible
+	u32 block;
+} device_allocation;
+
+typedef struct {
+	VkDeviceSize offset;
+	VkDeviceSize size;
+	memory_kind kind;
+} memory_chunk;
+
+typedef struct {
+	VkDeviceMemory mem;
+	VkDeviceSize size;
+	void *mapped;
+	u32 type;
+	memory_chunk *chunk; // sorted by offset, free chunks never adjacent
+	u32 n_chunk;
+	u32 c_chunk;
+} memory_block;
+
+typedef struct device_allocator {
+	memory_block *block;
+	u32 n_block;
+	u32 c_block;
+	VkDeviceSize block_size[VK_MAX_MEMORY_TYPES];
+	VkDeviceSize granularity;
+} device_allocator;
+
+device_allocator *device_allocator_create(VkPhysicalDeviceMemoryProperties *mem,
+	VkDeviceSize granularity);
+void device_allocator_destroy(context *ctx);
+device_allocation device_alloc(context *ctx, VkMemoryRequirements *req,
+	VkMemoryPropertyFlags cons, memory_kind kind);
+void device_free(context *ctx, device_allocation a);
+void device_allocator_trim(context *ctx);
+
+#endif /* GALA_ALLOCATOR_H */
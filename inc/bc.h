@@ -0,0 +1,15 @@
+#ifndef GALA_BC_H
+#define GALA_BC_H
+
+#include "types.h"
+
+
+// block compression of 4x4 rgba8 texels, row major, for bin/bake;
+// both work on the stored values so they suit the srgb formats too
+
+// 8 bytes, opaque 4 color blocks only
+void bc1_encode_block(const u8 texel[16][4], u8 dest[8]);
+// 16 bytes, mode 6 only: a single rgba line with 16 steps
+void bc7_encode_block(const u8 texel[16][4], u8 dest[16]);
+
+#endif /* GALA_BC_H */
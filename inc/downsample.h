@@ -0,0 +1,38 @@
+#ifndef GALA_DOWNSAMPLE_H
+#define GALA_DOWNSAMPLE_H
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include "types.h"
+#include "gpu.h"
+#include "memory.h"
+#include "image.h"
+#include "shared.h"
+
+
+// the levels of an image reduced from a source in a single dispatch of
+// downsample.comp, the source being a level of the same image, as for
+// mips, or another one, as the depth buffer for the hi-z pyramid
+
+typedef struct {
+	VkImageView source; // sampled, every layer
+	VkImageView level[DOWNSAMPLE_MAX_LEVELS]; // storage, padded with the last one
+	vulkan_buffer done; // workgroups done with each layer of dest
+	u32 n_level;
+	VkExtent2D dim;     // of the source, or twice the first level if larger
+	u32 n_layer;        // reduced by each dispatch
+} downsample_chain;
+
+// from the source level of src into dest from first_level down to 1x1,
+// srgb images are written through unorm views as downsample.comp expects
+downsample_chain downsample_chain_create(context *ctx,
+	vulkan_bound_image *src, u32 src_level, VkImageAspectFlags aspect,
+	vulkan_bound_image *dest, u32 first_level, u32 n_layer);
+void downsample_chain_destroy(context *ctx, downsample_chain *c);
+// with a downsample.comp pipeline and the chain's set bound, the n_layer
+// layers of the source into those of dest from baseindex; the levels must
+// be in VK_IMAGE_LAYOUT_GENERAL and done with by anything before
+void downsample_dispatch(VkCommandBuffer cmd, VkPipelineLayout layout,
+	downsample_chain *c, u32 baseindex);
+
+#endif /* GALA_DOWNSAMPLE_H */
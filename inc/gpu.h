@@ -5,6 +5,7 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include "types.h"
+struct device_allocator;
 
 
 typedef struct {
@@ -14,6 +15,12 @@ typedef struct {
 	u32 iq_graphics;
 	u32 iq_compute;
 	u32 iq_transfer;
+	// VkPhysicalDeviceSubgroupProperties, no operations before 1.1
+	u32 subgroup_size;
+	VkShaderStageFlags subgroup_stages;
+	VkSubgroupFeatureFlags subgroup_ops;
+	bool timeline_semaphore; // 1.2 devices, or 1.1 with the extension
+	bool timeline_khr;       // through VK_KHR_timeline_semaphore
 	u32 n_queue_families;
 	VkQueueFamilyProperties queue_families[];
 } *gpu_specs;
@@ -25,6 +32,7 @@ typedef struct {
 		float x, y;
 		float dx, dy;
 	} mouse;
+	u32 api_version; // of the instance, 1.0 to 1.2
 	VkInstance vk_instance;
 	VkPhysicalDevice physical_device;
 	VkDevice device;
@@ -36,6 +44,17 @@ typedef struct {
 		VkExtent2D dim;
 	} present_surface;
 	gpu_specs specs;
+	u32 family[3]; // distinct queue families a queue was created from
+	u32 n_family;
+	struct device_allocator *alloc;
+	// shared by every pipeline, kept on disk between runs
+	VkPipelineCache pipeline_cache;
+	// VK_KHR_draw_indirect_count, NULL when the device lacks it
+	PFN_vkCmdDrawIndexedIndirectCountKHR cmd_draw_indexed_indirect_count;
+	PFN_vkCmdDrawIndirectCountKHR cmd_draw_indirect_count;
+	// core or VK_KHR_timeline_semaphore ones, see sync.h
+	PFN_vkWaitSemaphores wait_semaphores;
+	PFN_vkGetSemaphoreCounterValue get_semaphore_counter_value;
 } context;
 
 context context_init(int width, int height, const char *title);
@@ -16,6 +16,7 @@ typedef struct {
 
 loaded_image load_image(const char *path);
 void loaded_image_fini(loaded_image img);
+void loaded_image_average(loaded_image img, float dest[4]);
 u32 mips_for(u32 width, u32 height);
 
 VkImageView vulkan_image_view_create_external(context *ctx, VkImage handle,
@@ -24,7 +25,7 @@ void vulkan_image_view_destroy(context *ctx, VkImageView view);
 
 typedef struct {
 	VkImage handle;
-	VkDeviceMemory mem;
+	device_allocation mem;
 	VkImageView view;
 	VkExtent2D dim;
 	VkFormat fmt;
@@ -35,14 +36,20 @@ typedef struct {
 vulkan_bound_image vulkan_bound_image_create(context *ctx,
 	VkImageCreateInfo *desc, VkMemoryPropertyFlags memory, VkImageAspectFlags kind);
 void vulkan_bound_image_destroy(context *ctx, vulkan_bound_image *bnd);
+vulkan_bound_image vulkan_bound_image_create_layered(context *ctx,
+	VkFormat fmt, u32 width, u32 height, u32 mips, u32 n_img);
+vulkan_bound_image vulkan_bound_image_create_generated(context *ctx,
+	VkFormat fmt, u32 width, u32 height, u32 mips, u32 n_img);
+VkImageView vulkan_image_view_create_layers(context *ctx, vulkan_bound_image *img,
+	u32 level, VkFormat fmt, VkImageAspectFlags kind);
 void vulkan_bound_image_layout_transition(VkCommandBuffer cmd, vulkan_bound_image *img,
 	VkImageLayout prev, VkImageLayout next);
 void vulkan_bound_image_transfer(VkCommandBuffer cmd,
-	vulkan_buffer buf, vulkan_bound_image *img);
-void vulkan_bound_image_mips_transition(VkCommandBuffer cmd,
-	vulkan_bound_image *img);
+	vulkan_buffer buf, VkDeviceSize offset, vulkan_bound_image *img, u32 layer);
 vulkan_bound_image vulkan_bound_image_upload(context *ctx,
 	u32 n_img, loaded_image *img, struct lifetime *l);
+vulkan_bound_image vulkan_bound_image_decode(context *ctx,
+	u32 n_img, const char *const *path, float (*average)[4], struct lifetime *l);
 
 VkFormat constrain_format(VkPhysicalDevice physical, u32 n_option, VkFormat *option,
 	VkImageTiling tiling, VkFormatFeatureFlags constraints);
@@ -8,15 +8,21 @@
 #include "hwqueue.h"
 #include "memory.h"
 #include "image.h"
+#include "sync.h"
 
 
 typedef struct lifetime {
 	hw_queue q;
+	hw_queue owner; // queue the uploaded resources are handed to
 	VkCommandPool pool;
 	VkCommandBuffer *cmd;
-	VkFence *wait;
+	timeline done;  // signaled by every submission of q
+	u64 *released;  // value of each command buffer's last submission
+	VkDeviceSize *mark; // ring head when the command buffer was submitted
+	bool *busy;
 	u32 n_cmd;
 	u32 i_cmd;
+	staging_ring ring;
 
 	vulkan_buffer *buf;
 	u32 n_buf;
@@ -29,15 +35,39 @@ typedef struct lifetime {
 	VkSampler *sm;
 	u32 n_sm;
 	u32 c_sm;
+
+	VkSemaphore *sem;
+	u32 n_sem;
+	u32 c_sem;
+
+	// acquire halves of the ownership transfers to owner
+	VkBufferMemoryBarrier *acq_buf;
+	u32 n_acq_buf;
+	u32 c_acq_buf;
+
+	VkImageMemoryBarrier *acq_img;
+	u32 n_acq_img;
+	u32 c_acq_img;
 } lifetime;
 
-lifetime lifetime_init(context *ctx, hw_queue q,
-	VkCommandPoolCreateFlags flags, u32 n_cmd);
+lifetime lifetime_init(context *ctx, hw_queue q, hw_queue owner,
+	VkCommandPoolCreateFlags flags, u32 n_cmd, VkDeviceSize staging);
 u32 lifetime_acquire(lifetime *l, context *ctx);
 void lifetime_release(lifetime *l, u32 icmd);
+void lifetime_release_after(lifetime *l, u32 icmd,
+	timeline_point wait, VkPipelineStageFlags stage);
+void *lifetime_try_stage(lifetime *l, VkDeviceSize size, VkDeviceSize *offset);
+void *lifetime_stage(lifetime *l, context *ctx,
+	VkDeviceSize size, VkDeviceSize *offset);
 void lifetime_bind_buffer(lifetime *l, vulkan_buffer buf);
 void lifetime_bind_image(lifetime *l, vulkan_bound_image img);
 void lifetime_bind_sampler(lifetime *l, VkSampler sm);
+void lifetime_bind_semaphore(lifetime *l, VkSemaphore sem);
+void lifetime_hand_buffer(lifetime *l, VkCommandBuffer cmd,
+	vulkan_buffer buf, VkAccessFlags access);
+void lifetime_hand_image(lifetime *l, VkCommandBuffer cmd,
+	vulkan_bound_image *img, VkImageLayout layout, VkAccessFlags access);
+timeline_point lifetime_handoff(lifetime *l, VkCommandBuffer cmd);
 void lifetime_fini(lifetime *l, context *ctx);
 
 #endif /* GALA_LIFETIME_H */
@@ -4,6 +4,7 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include "gpu.h"
+#include "allocator.h"
 struct lifetime; // circular dependency
 
 
@@ -12,18 +13,39 @@ u32 constrain_memory_type(context *ctx, u32 allowed,
 
 typedef struct vulkan_buffer {
 	VkBuffer handle;
-	VkDeviceMemory mem;
+	device_allocation mem;
 	VkDeviceSize size;
+	bool shared; // concurrent across ctx->family, no ownership to transfer
 } vulkan_buffer;
 
 vulkan_buffer buffer_create(context *ctx,
 	VkDeviceSize size, VkBufferUsageFlags usage,
 	VkMemoryPropertyFlags cons);
+vulkan_buffer buffer_create_shared(context *ctx,
+	VkDeviceSize size, VkBufferUsageFlags usage,
+	VkMemoryPropertyFlags cons);
 
+void buffer_destroy(context *ctx, vulkan_buffer buf);
+
+// head and tail only ever grow, the ring offset is their modulo
+typedef struct {
+	vulkan_buffer buf;
+	char *mapped;
+	VkDeviceSize align;
+	VkDeviceSize head;
+	VkDeviceSize tail;
+} staging_ring;
+
+staging_ring staging_ring_create(context *ctx, VkDeviceSize size);
+void staging_ring_destroy(context *ctx, staging_ring *ring);
+bool staging_ring_reserve(staging_ring *ring, VkDeviceSize size,
+	VkDeviceSize *offset);
 void *buffer_map(context *ctx, vulkan_buffer buf);
 void buffer_unmap(context *ctx, vulkan_buffer buf);
 vulkan_buffer data_upload(context *ctx, VkDeviceSize size, const void *data,
 	struct lifetime *l, VkBufferUsageFlags usage);
+vulkan_buffer data_upload_shared(context *ctx, VkDeviceSize size, const void *data,
+	struct lifetime *l, VkBufferUsageFlags usage);
 
 #endif /* GALA_MEMORY_H */
 
@@ -0,0 +1,45 @@
+#ifndef GALA_MESH_H
+#define GALA_MESH_H
+
+#include <cglm/cglm.h>
+#include "types.h"
+
+
+typedef struct {
+	vec3 position;
+	vec3 normal;
+	vec2 uv;
+} vertex;
+
+// 16 bit indices, every mesh stays below 65536 vertices
+typedef struct {
+	vertex *vert;
+	u16 *indx;
+	u32 nvert;
+	u32 nindx;
+} mesh;
+
+// what the vertex buffer holds: a sphere's position is its normal times
+// the radius, so only the octahedral encoded normal is kept
+typedef struct {
+	i16 normal[2]; // snorm16
+	u16 uv[2];     // unorm16, u is halved as seam copies reach 2
+} packed_vertex;
+
+u32 uv_sphere_vert_size(u32 nx, u32 ny);
+u32 uv_sphere_indx_size(u32 nx, u32 ny);
+mesh uv_sphere(u32 nx, u32 ny, float r, vertex *vert, u16 *indx);
+u32 cube_sphere_vert_size(u32 n);
+u32 cube_sphere_indx_size(u32 n);
+mesh cube_sphere(u32 n, float r, vertex *vert, u16 *indx);
+mesh impostor_quad(vertex *vert, u16 *indx);
+
+// triangle order for the post-transform cache, then vertex
+// order for fetch locality; the vertex count may only shrink
+void mesh_optimize_cache(mesh *m);
+void mesh_optimize_fetch(mesh *m);
+// average transformed vertices per triangle with a FIFO cache
+float mesh_acmr(const mesh *m, u32 cache_size);
+void mesh_pack(const mesh *m, packed_vertex *dest);
+
+#endif /* GALA_MESH_H */
@@ -0,0 +1,64 @@
+#ifndef GALA_QUERY_H
+#define GALA_QUERY_H
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include <stdbool.h>
+#include "types.h"
+#include "gpu.h"
+#include "shared.h"
+
+
+// what a frame's command buffers are timed by
+typedef enum {
+	PASS_CLEAR,         // splat and draw stream of the slot
+	PASS_PROPAGATE,     // every depth of the orbit tree
+	PASS_UPDATE_MODELS,
+	PASS_MAKE_DRAWS,
+	PASS_RENDER,        // the whole render pass
+	PASS_PYRAMID,
+	PASS_COUNT,
+} gpu_pass;
+
+enum { QUERY_HISTORY = 256 }; // frames the statistics are taken over
+
+typedef struct {
+	u32 samples;
+	float mean_ms;
+	float p50_ms;
+	float p95_ms;
+	float p99_ms;
+	// of the latest frame read back, 0 without pipelineStatisticsQuery
+	u64 vertex_invocations;
+	u64 fragment_invocations;
+	u64 compute_invocations;
+} gpu_pass_report;
+
+// one set of pools per frame slot, read back when the slot comes
+// around again so nothing ever waits on the results
+typedef struct {
+	bool timestamps;
+	bool statistics;
+	u64 mask; // valid timestamp bits of the queues used
+	double period_ms;
+	VkQueryPool time[MAX_FRAMES_RENDERING];     // begin and end of each pass
+	VkQueryPool compute[MAX_FRAMES_RENDERING];  // invocations of each pass
+	VkQueryPool graphics[MAX_FRAMES_RENDERING]; // only PASS_RENDER
+	u32 recorded[MAX_FRAMES_RENDERING]; // passes recorded, a mask
+	float history[PASS_COUNT][QUERY_HISTORY];
+	u32 n_history[PASS_COUNT];
+	u32 i_history[PASS_COUNT];
+	u64 invocations[PASS_COUNT][3]; // vertex, fragment, compute
+} gpu_profiler;
+
+gpu_profiler gpu_profiler_create(context *ctx, u32 n_family, const u32 *family);
+void gpu_profiler_destroy(context *ctx, gpu_profiler *p);
+void gpu_profiler_collect(context *ctx, gpu_profiler *p, u32 frame);
+void gpu_profiler_begin(gpu_profiler *p, VkCommandBuffer cmd,
+	u32 frame, gpu_pass pass);
+void gpu_profiler_end(gpu_profiler *p, VkCommandBuffer cmd,
+	u32 frame, gpu_pass pass);
+gpu_pass_report gpu_profiler_report(const gpu_profiler *p, gpu_pass pass);
+const char *gpu_pass_name(gpu_pass pass);
+
+#endif /* GALA_QUERY_H */
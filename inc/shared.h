@@ -5,8 +5,37 @@
 #include <cglm/cglm.h>
 #include "types.h"
 typedef u32 uint;
+typedef struct draw_command draw_command;
+typedef struct draw_pulled draw_pulled;
+typedef struct draw_stream draw_stream;
+typedef struct texture_residency texture_residency;
 #endif
 
+#define MAX_FRAMES_RENDERING (2)
+#define MAX_ITEMS_PER_FRAME (1 << 19)
+#define MAX_ITEMS (MAX_ITEMS_PER_FRAME * MAX_FRAMES_RENDERING)
+#define MAX_LOD (4)
+#define LOCAL_SIZE (1 << 6)
+#define CHUNK_COUNT (1 << 8)
+#define ITEM_PER_CHUNK (MAX_ITEMS_PER_FRAME / CHUNK_COUNT)
+// the last lod is splatted into a screen sized image, not drawn
+#define DRAWN_LOD (MAX_LOD - 1)
+// lods from this one are ray-cast on a quad instead of meshed
+#define IMPOSTOR_LOD (1)
+// splat units of a body covering a whole pixel
+#define SPLAT_UNIT (64.0)
+// levels built by a dispatch of downsample, from up to 8192x8192
+#define DOWNSAMPLE_MAX_LEVELS (13)
+// body textures, texindex is below it
+#define MAX_TEXTURES (256)
+// samples filtered along the major axis of a texel's footprint, every
+// device with samplerAnisotropy allows as many
+#define TEXTURE_ANISOTROPY (16)
+// specialization constants of the simulation shaders, LOCAL_SIZE
+// and the tolerances of best_lod are only their defaults
+#define SPEC_LOCAL_SIZE (0)
+#define SPEC_TOLERANCE (1) // MAX_LOD - 1 of them
+
 struct push_constant_data {
 	mat4 viewproj;
 	vec4 cam_pos;
@@ -16,18 +45,12 @@ struct push_constant_data {
 	uint lod;
 	float time;
 	float dt;
+	uint level_base; // nodes of the propagated depth
+	uint level_end;
+	uint downsample_levels; // built by downsample
+	uint sphere_tess[IMPOSTOR_LOD]; // nx | ny << 16 of the pulled spheres
 };
 
-#define MAX_FRAMES_RENDERING (2)
-#define MAX_ITEMS_PER_FRAME (1 << 19)
-#define MAX_ITEMS (MAX_ITEMS_PER_FRAME * MAX_FRAMES_RENDERING)
-#define MAX_LOD (4)
-#define LOCAL_SIZE (1 << 6)
-#define CHUNK_COUNT (1 << 8)
-#define ITEM_PER_CHUNK (MAX_ITEMS_PER_FRAME / CHUNK_COUNT)
-#define MAX_DRAW_PER_FRAME (CHUNK_COUNT * MAX_LOD)
-#define MAX_DRAW (MAX_DRAW_PER_FRAME * MAX_FRAMES_RENDERING)
-
 struct orbit_spec {
 	vec4 startoffset[MAX_ITEMS_PER_FRAME];
 	vec4 orbitorient[MAX_ITEMS_PER_FRAME];
@@ -36,8 +59,132 @@ struct orbit_spec {
 	vec4 selfderiv[MAX_ITEMS_PER_FRAME];
 	float itemscale[MAX_ITEMS_PER_FRAME];
 	float texindex[MAX_ITEMS_PER_FRAME];
-	uint parent[MAX_ITEMS_PER_FRAME];
+	uint parent[MAX_ITEMS_PER_FRAME]; // nodes are sorted by depth
+};
+
+// VkDrawIndexedIndirectCommand
+struct draw_command {
+	uint indexCount;
+	uint instanceCount;
+	uint firstIndex;
+	int  vertexOffset;
+	uint firstInstance;
+};
+
+// VkDrawIndirectCommand, for vertices pulled from gl_VertexIndex
+struct draw_pulled {
+	uint vertexCount;
+	uint instanceCount;
+	uint firstVertex;
+	uint firstInstance;
+};
+
+// what drawbuf holds per frame, the counters up to mesh are
+// cleared at the start of the frame, see DRAW_STREAM_RESET
+struct draw_stream {
+	uint count;              // draws to issue
+	uint visible[DRAWN_LOD]; // instances counted by update_models
+	uint next_tile;          // make_draws tiles in scheduling order
+	uint tile_state[CHUNK_COUNT * DRAWN_LOD]; // look-back flag | count
+	// constant geometry of each meshed lod, then the impostor quad
+	draw_command mesh[IMPOSTOR_LOD + 1];
+	// non empty meshed lods first, then every impostor in one draw
+	draw_command draw[IMPOSTOR_LOD + 1];
+	// the same meshed draws, as procedural spheres
+	draw_pulled pulled[IMPOSTOR_LOD];
+	// camera the depth pyramid of this slot was rendered with
+	vec4 occluder_viewproj[4];
+	uint occluder_dim[2]; // depth buffer size
+	uint occluder_valid;  // no pyramid before the slot is first rendered
+	uint occluder_pad;
+};
+#define DRAW_STREAM_RESET ((2 + DRAWN_LOD + CHUNK_COUNT * DRAWN_LOD) * 4)
+
+// what instbuf holds per item, 32 bytes instead of a mat4
+struct instance {
+	vec4 pos_scale;  // world position, uniform scale
+	uint orient[2];  // unit quaternion as snorm16 xy, zw
+	uint texindex;
+	uint pad;
+};
+
+// where the fragment shaders find each texture, written by stream.c
+struct texture_residency {
+	uint tail_mip; // level 0 of the tail image, every finer one is streamed
+	uint pad[3];
+	uint entry[MAX_TEXTURES]; // detail layer | finest level streamed in << 16
 };
 
+#if !defined(__STDC__) && !defined(__cplusplus)
+mat3 quat2mat3(vec4 q)
+{
+	return mat3(
+		vec3(2.0 * (q.w*q.w + q.x*q.x) - 1.0, 2.0 * (q.x*q.y + q.w*q.z)      , 2.0 * (q.x*q.z - q.w*q.y)      ),
+		vec3(2.0 * (q.x*q.y - q.w*q.z)      , 2.0 * (q.w*q.w + q.y*q.y) - 1.0, 2.0 * (q.y*q.z + q.w*q.x)      ),
+		vec3(2.0 * (q.x*q.z + q.w*q.y)      , 2.0 * (q.y*q.z - q.w*q.x)      , 2.0 * (q.w*q.w + q.z*q.z) - 1.0)
+	);
+}
+
+vec3 quat_rotate(vec4 q, vec3 v)
+{
+	vec3 t = 2.0 * cross(q.xyz, v);
+	return v + q.w * t + cross(q.xyz, t);
+}
+
+vec4 instance_orient(instance inst)
+{
+	vec4 q = vec4(unpackSnorm2x16(inst.orient[0]), unpackSnorm2x16(inst.orient[1]));
+	return normalize(q);
+}
+
+// inverse of oct_encode in mesh.c
+vec3 oct_decode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));
+	return normalize(n);
+}
+
+// splat pixels pack rgb as 11:11:10 bit counts of SPLAT_UNIT
+uint splat_add(uint acc, uvec3 c)
+{
+	uvec3 sum = min(
+		uvec3(acc & 0x7ffu, (acc >> 11) & 0x7ffu, acc >> 22) + c,
+		uvec3(0x7ffu, 0x7ffu, 0x3ffu));
+	return sum.r | (sum.g << 11) | (sum.b << 22);
+}
+
+vec3 splat_color(uint acc)
+{
+	return vec3(acc & 0x7ffu, (acc >> 11) & 0x7ffu, acc >> 22) / SPLAT_UNIT;
+}
+
+// samples the detail layer of a texture down to the finest level streamed
+// in, the coarser levels from the tail; uvw.z is the texture's tail layer.
+// Clamping the level needs sparse residency, the gradients are scaled
+// up instead. lod is the level anisotropic filtering reads, as many as
+// TEXTURE_ANISOTROPY samples along the major axis of the footprint, up to
+// that many times finer than the isotropic level of that axis
+vec4 texture_streamed(sampler2DArray detail, sampler2DArray tail,
+	uint tail_mip, uint entry, vec3 uvw, vec2 dx, vec2 dy)
+{
+	vec2 size = vec2(textureSize(detail, 0).xy);
+	float px = length(dx * size);
+	float py = length(dy * size);
+	float major = max(max(px, py), 1e-6);
+	float minor = max(min(px, py), 1e-6);
+	float n = min(ceil(major / minor), float(TEXTURE_ANISOTROPY));
+	float lod = log2(major / n);
+	float finest = float(min(entry >> 16, tail_mip));
+	float lift = exp2(max(finest - lod, 0.0));
+	if (max(lod, finest) < float(tail_mip)) {
+		vec3 slot = vec3(uvw.xy, float(entry & 0xffffu));
+		return textureGrad(detail, slot, lift * dx, lift * dy);
+	}
+	return textureGrad(tail, uvw, lift * dx, lift * dy);
+}
+#endif
+
 #endif /* GALA_SHARED_H */
 
@@ -0,0 +1,66 @@
+#ifndef GALA_STREAM_H
+#define GALA_STREAM_H
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include <stdbool.h>
+#include "types.h"
+#include "gpu.h"
+#include "memory.h"
+#include "image.h"
+#include "texture.h"
+#include "shared.h"
+struct lifetime;
+
+
+// body textures streamed by how near their bodies are: the mip tail of
+// every layer is loaded up front, the finer levels are copied from the
+// baked file into a pool of detail layers as update_models asks for them
+// and the detail layers are taken back from the textures needing the least
+
+enum { STREAM_NONE = UINT32_MAX };
+
+typedef struct {
+	const texture_file *file; // NULL when everything is resident
+	u32 n_texture;
+	u32 tail_mip;
+	u32 n_slot;
+	vulkan_bound_image tail;   // every layer from tail_mip on
+	vulkan_bound_image detail; // n_slot layers of tail_mip + 1 levels
+	vulkan_buffer residency;   // texture_residency, read by the fragment shaders
+	vulkan_buffer feedback;    // texels needed by each frame slot, see update_models
+	const u32 *texels_needed;
+	vulkan_buffer staging;     // a region per frame slot
+	char *staged;
+	VkDeviceSize align;        // of every level in staging
+	VkDeviceSize upload_budget;
+	VkDeviceSize staging_size; // of each frame slot
+	u32 *needed;  // finest level each texture was last asked for
+	u32 *finest;  // finest level in its detail layer, tail_mip + 1 when empty
+	u32 *slot;    // detail layer of each texture
+	u32 *owner;   // texture of each detail layer
+	VkBufferImageCopy *region;     // the copies of a frame, max_copy of them
+	VkImageMemoryBarrier *barrier; // and the levels they write
+	u32 max_copy;
+	texture_residency table;
+	bool dirty;   // table is not what residency holds
+	VkDeviceSize uploaded; // bytes copied since creation
+} texture_stream;
+
+// budget bounds the detail layers, upload_budget the bytes copied by a
+// frame unless a single level is bigger; f must stay open meanwhile
+// and tail is left in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, handed over
+// to the owner of l
+texture_stream texture_stream_create(context *ctx, const texture_file *f,
+	u32 tail_width, VkDeviceSize budget, VkDeviceSize upload_budget,
+	struct lifetime *l);
+// image sampled as it is, nothing is streamed
+texture_stream texture_stream_resident(context *ctx, vulkan_bound_image image);
+void texture_stream_destroy(context *ctx, texture_stream *s);
+// from VK_IMAGE_LAYOUT_UNDEFINED, once tail is owned by cmd's queue
+void texture_stream_layout_init(texture_stream *s, VkCommandBuffer cmd);
+// the feedback of frame must be done being written; records the copies
+// the budgets allow into cmd, before anything sampling the textures
+void texture_stream_update(texture_stream *s, VkCommandBuffer cmd, u32 frame);
+
+#endif /* GALA_STREAM_H */
@@ -7,7 +7,9 @@
 #include "gpu.h"
 #include "hwqueue.h"
 #include "image.h"
+#include "downsample.h"
 #include "shared.h"
+#include "sync.h"
 
 
 typedef struct {
@@ -26,6 +28,10 @@ void vulkan_swapchain_destroy(context *ctx, vulkan_swapchain *sc);
 typedef struct {
 	vulkan_swapchain base;
 	vulkan_bound_image depth_buffer;
+	// hi-z of the last frame rendered in each slot, one layer per slot
+	vulkan_bound_image depth_pyramid;
+	downsample_chain pyramid_chain; // from depth_buffer into a layer
+	u32 pyramid_levels;
 	VkRenderPass pass;
 	VkFramebuffer *framebuffer;
 	hw_queue graphics_queue;
@@ -33,16 +39,27 @@ typedef struct {
 	VkCommandBuffer graphics_cmd[MAX_FRAMES_RENDERING];
 	VkSemaphore present_ready[MAX_FRAMES_RENDERING];
 	VkSemaphore render_done[MAX_FRAMES_RENDERING];
-	VkFence rendering[MAX_FRAMES_RENDERING];
+	// signaled by every graphics submission, rendered is the value
+	// of the last one in each slot
+	timeline graphics_timeline;
+	u64 rendered[MAX_FRAMES_RENDERING];
+	// simulation submitted apart from rendering, see async_compute
+	bool async_compute;
+	hw_queue compute_queue;
+	VkCommandPool compute_pool;
+	VkCommandBuffer compute_cmd[MAX_FRAMES_RENDERING];
+	timeline compute_timeline; // signaled by every simulation
 	u32 frame_indx;
 } attached_swapchain;
 
-attached_swapchain attached_swapchain_create(context *ctx);
+attached_swapchain attached_swapchain_create(context *ctx, bool async_compute);
 void attached_swapchain_destroy(context *ctx, attached_swapchain *sc);
 VkCommandBuffer attached_swapchain_current_graphics_cmd(attached_swapchain *sc);
 VkSemaphore *attached_swapchain_current_present_ready(attached_swapchain *sc);
 VkSemaphore *attached_swapchain_current_render_done(attached_swapchain *sc);
-VkFence attached_swapchain_current_rendering(attached_swapchain *sc);
+timeline_point attached_swapchain_current_rendered(attached_swapchain *sc);
+timeline_point attached_swapchain_advance_rendered(attached_swapchain *sc);
+VkCommandBuffer attached_swapchain_current_compute_cmd(attached_swapchain *sc);
 void attached_swapchain_swap_buffers(context *ctx, attached_swapchain *sc);
 void attached_swapchain_present(attached_swapchain *sc);
 
@@ -5,17 +5,44 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include "types.h"
+#include "gpu.h"
 #include <stdbool.h>
 
+// a timeline semaphore and the value its latest submission signals,
+// every submission signaling it takes the next value
+typedef struct {
+	VkSemaphore handle;
+	u64 submitted;
+} timeline;
+
+// what a submission waits on or signals, a binary semaphore has value 0
+typedef struct {
+	VkSemaphore handle;
+	u64 value;
+} timeline_point;
+
+enum { SUBMIT_MAX_SEMAPHORES = 4 };
+
+typedef struct {
+	VkSemaphore wait[SUBMIT_MAX_SEMAPHORES];
+	u64 wait_value[SUBMIT_MAX_SEMAPHORES];
+	VkPipelineStageFlags wait_stage[SUBMIT_MAX_SEMAPHORES];
+	u32 n_wait;
+	VkSemaphore signal[SUBMIT_MAX_SEMAPHORES];
+	u64 signal_value[SUBMIT_MAX_SEMAPHORES];
+	u32 n_signal;
+} submit_sync;
+
 void gpu_fence_create(VkDevice device, u32 cnt, VkSemaphore *sem);
-void cpu_fence_create(VkDevice device, u32 cnt, VkFence *fence,
-	VkFenceCreateFlags flags);
-bool cpu_fence_wait_one(VkDevice device,
-	VkFence fence, u64 timeout_ns);
-bool cpu_fence_wait_all(VkDevice device,
-	u32 n_fence, VkFence *fence, u64 timeout_ns);
-u32 cpu_fence_wait_any(VkDevice device,
-	u32 n_fence, VkFence *fence, u64 timeout_ns);
+timeline timeline_create(VkDevice device);
+void timeline_destroy(VkDevice device, timeline *t);
+timeline_point timeline_advance(timeline *t);
+timeline_point timeline_last(timeline *t);
+u64 timeline_reached(context *ctx, timeline *t);
+bool timeline_wait(context *ctx, timeline_point p, u64 timeout_ns);
+void submit_wait(submit_sync *s, timeline_point p, VkPipelineStageFlags stage);
+void submit_signal(submit_sync *s, timeline_point p);
+void queue_submit(VkQueue queue, u32 n_cmd, const VkCommandBuffer *cmd,
+	const submit_sync *s);
 
 #endif /* GALA_SYNC_H */
-
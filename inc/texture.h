@@ -0,0 +1,57 @@
+#ifndef GALA_TEXTURE_H
+#define GALA_TEXTURE_H
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "types.h"
+#include "gpu.h"
+#include "image.h"
+struct lifetime;
+
+
+// layered textures baked by bin/bake with their whole mip chain, laid
+// out as they are copied to the image: the header, n_layer averages,
+// n_layer * n_mip levels layer major, then every level's texels
+#define TEXTURE_MAGIC 0x58455447u // "GTEX"
+enum { TEXTURE_VERSION = 2 }; // 2: linear averages
+enum { TEXTURE_ALIGN = 16 }; // of every level, a multiple of any texel block
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 format; // VkFormat
+	u32 width;
+	u32 height;
+	u32 n_layer;
+	u32 n_mip;
+	u32 reserved;
+} texture_header;
+
+typedef struct {
+	u64 offset; // from the start of the file
+	u64 size;
+	u32 width;
+	u32 height;
+} texture_level;
+
+typedef struct {
+	void *mapped;
+	size_t size;
+	const texture_header *header;
+	const float (*average)[4]; // the mean color of each layer
+	const texture_level *level;
+} texture_file;
+
+// false when there is no such file, crashes on a malformed one
+bool texture_file_open(const char *path, texture_file *dest);
+void texture_file_close(texture_file *f);
+const texture_level *texture_file_level(const texture_file *f, u32 layer, u32 mip);
+// the levels from first_mip on, the image's level 0 is first_mip;
+// leaves every mip in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+// handed over to the owner of l, nothing is left to generate
+vulkan_bound_image texture_file_upload(context *ctx,
+	const texture_file *f, u32 first_mip, struct lifetime *l);
+
+#endif /* GALA_TEXTURE_H */
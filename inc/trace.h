@@ -0,0 +1,39 @@
+#ifndef GALA_TRACE_H
+#define GALA_TRACE_H
+
+#include "types.h"
+
+
+// scoped cpu timing zones, recorded with -DGALA_TRACE (make TRACE=1)
+// and compiled out otherwise; every thread keeps the last TRACE_EVENTS
+// zones it closed, TRACE_DUMP writes them as chrome://tracing json
+#ifdef GALA_TRACE
+
+enum { TRACE_EVENTS = 1 << 16 };
+
+typedef struct {
+	const char *name; // not copied, a string literal
+	u64 begin_ns;
+} trace_zone;
+
+trace_zone trace_zone_begin(const char *name);
+void trace_zone_end(trace_zone *zone);
+// once every other recording thread is done
+void trace_dump(const char *path);
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// times the rest of the enclosing block
+#define TRACE_ZONE(name) \
+	__attribute__((cleanup(trace_zone_end))) trace_zone \
+	TRACE_CONCAT(trace_zone_, __LINE__) = trace_zone_begin(name)
+#define TRACE_DUMP(path) trace_dump(path)
+
+#else
+
+#define TRACE_ZONE(name) ((void) 0)
+#define TRACE_DUMP(path) ((void) 0)
+
+#endif /* GALA_TRACE */
+
+#endif /* GALA_TRACE_H */
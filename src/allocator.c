@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "allocator.h"
+#include "memory.h"
+#include "util.h"
+
+
+enum { DEFAULT_BLOCK_SIZE = 256 << 20 };
+
+static VkDeviceSize align_up(VkDeviceSize x, VkDeviceSize align)
+{
+	return (x + align - 1) & ~(align - 1);
+}
+
+static VkDeviceSize page_of(VkDeviceSize x, VkDeviceSize granularity)
+{
+	return x & ~(granularity - 1);
+}
+
+device_allocator *device_allocator_create(VkPhysicalDeviceMemoryProperties *mem,
+	VkDeviceSize granularity)
+{
+	device_allocator *a = xmalloc(sizeof(*a));
+	a->n_block = 0;
+	a->c_block = 4;
+	a->block = xmalloc(a->c_block * sizeof(*a->block));
+	a->granularity = granularity;
+	for (u32 i = 0; i < mem->memoryTypeCount; i++) {
+		// small heaps (e.g. the host visible device local window)
+		// should not be exhausted by a single block
+		VkDeviceSize heap = mem->memoryHeaps[mem->memoryTypes[i].heapIndex].size;
+		a->block_size[i] = MIN((VkDeviceSize) DEFAULT_BLOCK_SIZE, heap / 8);
+	}
+	return a;
+}
+
+static void block_release(context *ctx, memory_block *b)
+{
+	vkFreeMemory(ctx->device, b->mem, NULL);
+	free(b->chunk);
+	b->mem = VK_NULL_HANDLE;
+}
+
+void device_allocator_destroy(context *ctx)
+{
+	device_allocator *a = ctx->alloc;
+	for (u32 i = 0; i < a->n_block; i++) {
+		if (a->block[i].mem != VK_NULL_HANDLE)
+			block_release(ctx, &a->block[i]);
+	}
+	free(a->block);
+	free(a);
+}
+
+static u32 block_create(context *ctx, u32 type, VkDeviceSize size)
+{
+	device_allocator *a = ctx->alloc;
+	u32 ib = 0;
+	while (ib < a->n_block && a->block[ib].mem != VK_NULL_HANDLE)
+		ib++;
+	if (ib == a->n_block) {
+		if (a->n_block == a->c_block) {
+			a->c_block *= 2;
+			a->block = xrealloc(a->block, a->c_block * sizeof(*a->block));
+		}
+		a->n_block++;
+	}
+	VkMemoryAllocateInfo mem_desc = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = size,
+		.memoryTypeIndex = type,
+	};
+	memory_block *b = &a->block[ib];
+	if (vkAllocateMemory(ctx->device, &mem_desc, NULL, &b->mem) != VK_SUCCESS)
+		crash("vkAllocateMemory %zu bytes of type %u", (size_t) size, type);
+	b->size = size;
+	b->type = type;
+	b->mapped = NULL;
+	VkMemoryPropertyFlags flags = ctx->specs->memory.memoryTypes[type].propertyFlags;
+	if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		// mapped once for the whole block, a memory object
+		// cannot be mapped twice by its sub-allocations
+		if (vkMapMemory(ctx->device, b->mem, 0, VK_WHOLE_SIZE,
+			0, &b->mapped) != VK_SUCCESS)
+			crash("vkMapMemory");
+	}
+	b->c_chunk = 8;
+	b->chunk = xmalloc(b->c_chunk * sizeof(*b->chunk));
+	b->chunk[0] = (memory_chunk){ 0, size, MEMORY_FREE };
+	b->n_chunk = 1;
+	return ib;
+}
+
+static void chunk_insert(memory_block *b, u32 at, memory_chunk c)
+{
+	if (b->n_chunk == b->c_chunk) {
+		b->c_chunk *= 2;
+		b->chunk = xrealloc(b->chunk, b->c_chunk * sizeof(*b->chunk));
+	}
+	memmove(&b->chunk[at + 1], &b->chunk[at],
+		(b->n_chunk - at) * sizeof(*b->chunk));
+	b->chunk[at] = c;
+	b->n_chunk++;
+}
+
+static void chunk_remove(memory_block *b, u32 at)
+{
+	memmove(&b->chunk[at], &b->chunk[at + 1],
+		(b->n_chunk - at - 1) * sizeof(*b->chunk));
+	b->n_chunk--;
+}
+
+// first fit; free chunks are always surrounded by used ones
+// so only the direct neighbours can share a granularity page
+static bool block_fit(memory_block *b, VkDeviceSize granularity,
+	VkDeviceSize size, VkDeviceSize align, memory_kind kind,
+	VkDeviceSize *out_offset)
+{
+	for (u32 i = 0; i < b->n_chunk; i++) {
+		memory_chunk *c = &b->chunk[i];
+		if (c->kind != MEMORY_FREE || c->size < size)
+			continue;
+		VkDeviceSize off = align_up(c->offset, align);
+		if (i > 0) {
+			memory_chunk *prev = &b->chunk[i - 1];
+			VkDeviceSize prev_last = prev->offset + prev->size - 1;
+			if (prev->kind != kind
+			    && page_of(prev_last, granularity) == page_of(off, granularity))
+				off = align_up(off, granularity);
+		}
+		VkDeviceSize end = off + size;
+		if (end > c->offset + c->size)
+			continue;
+		if (i + 1 < b->n_chunk) {
+			memory_chunk *next = &b->chunk[i + 1];
+			if (next->kind != kind
+			    && page_of(end - 1, granularity) == page_of(next->offset, granularity))
+				continue;
+		}
+		VkDeviceSize chunk_end = c->offset + c->size;
+		u32 at = i;
+		if (off > c->offset) {
+			c->size = off - c->offset;
+			at++;
+			chunk_insert(b, at, (memory_chunk){ off, size, kind });
+		} else {
+			*c = (memory_chunk){ off, size, kind };
+		}
+		if (end < chunk_end) {
+			chunk_insert(b, at + 1,
+				(memory_chunk){ end, chunk_end - end, MEMORY_FREE });
+		}
+		*out_offset = off;
+		return true;
+	}
+	return false;
+}
+
+device_allocation device_alloc(context *ctx, VkMemoryRequirements *req,
+	VkMemoryPropertyFlags cons, memory_kind kind)
+{
+	assert(kind != MEMORY_FREE);
+	device_allocator *a = ctx->alloc;
+	u32 type = constrain_memory_type(ctx, req->memoryTypeBits, cons);
+	VkDeviceSize off;
+	u32 ib;
+	if (req->size > a->block_size[type] / 2) {
+		// too big to share a block with anything
+		ib = block_create(ctx, type, req->size);
+		if (!block_fit(&a->block[ib], a->granularity,
+			req->size, req->alignment, kind, &off))
+			crash("dedicated block cannot fit its allocation");
+	} else {
+		for (ib = 0; ib < a->n_block; ib++) {
+			memory_block *b = &a->block[ib];
+			if (b->mem != VK_NULL_HANDLE && b->type == type
+			    && block_fit(b, a->granularity,
+				req->size, req->alignment, kind, &off))
+				break;
+		}
+		if (ib == a->n_block) {
+			ib = block_create(ctx, type, a->block_size[type]);
+			if (!block_fit(&a->block[ib], a->granularity,
+				req->size, req->alignment, kind, &off))
+				crash("new block cannot fit its allocation");
+		}
+	}
+	memory_block *b = &a->block[ib];
+	return (device_allocation){
+		b->mem, off, req->size,
+		b->mapped ? (char*) b->mapped + off : NULL,
+		ib,
+	};
+}
+
+void device_free(context *ctx, device_allocation alloc)
+{
+	memory_block *b = &ctx->alloc->block[alloc.block];
+	assert(b->mem == alloc.mem);
+	u32 lo = 0, hi = b->n_chunk;
+	while (hi - lo > 1) {
+		u32 mid = (lo + hi) / 2;
+		if (b->chunk[mid].offset <= alloc.offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	assert(b->chunk[lo].offset == alloc.offset
+	    && b->chunk[lo].kind != MEMORY_FREE);
+	b->chunk[lo].kind = MEMORY_FREE;
+	if (lo + 1 < b->n_chunk && b->chunk[lo + 1].kind == MEMORY_FREE) {
+		b->chunk[lo].size += b->chunk[lo + 1].size;
+		chunk_remove(b, lo + 1);
+	}
+	if (lo > 0 && b->chunk[lo - 1].kind == MEMORY_FREE) {
+		b->chunk[lo - 1].size += b->chunk[lo].size;
+		chunk_remove(b, lo);
+	}
+}
+
+void device_allocator_trim(context *ctx)
+{
+	device_allocator *a = ctx->alloc;
+	for (u32 i = 0; i < a->n_block; i++) {
+		memory_block *b = &a->block[i];
+		if (b->mem != VK_NULL_HANDLE && b->n_chunk == 1
+		    && b->chunk[0].kind == MEMORY_FREE)
+			block_release(ctx, b);
+	}
+}
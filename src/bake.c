@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include "texture.h"
+#include "image.h"
+#include "util.h"
+#include "bc.h"
+
+
+// bin/bake [-f rgba8|bc1|bc7] out.gtex layer.jpg...
+// decodes every layer and writes it with its whole mip chain, filtered
+// in linear space like downsample.comp does, see texture.h
+
+typedef struct {
+	const char *name;
+	VkFormat fmt;
+	u32 block_dim; // texels on each side of a block
+	u32 block_size;
+	void (*encode)(const u8 texel[16][4], u8 *dest); // NULL if stored as is
+} bake_format;
+
+static const bake_format FORMATS[] = {
+	{ "rgba8", VK_FORMAT_R8G8B8A8_SRGB, 1, 4, NULL },
+	{ "bc1", VK_FORMAT_BC1_RGB_SRGB_BLOCK, 4, 8, bc1_encode_block },
+	{ "bc7", VK_FORMAT_BC7_SRGB_BLOCK, 4, 16, bc7_encode_block },
+};
+
+static float srgb_linear[256];
+
+static void srgb_init()
+{
+	for (u32 i = 0; i < 256; i++) {
+		float c = (float) i / 255.0f;
+		srgb_linear[i] = c <= 0.04045f? c / 12.92f:
+			powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+}
+
+static u8 linear_srgb(float c)
+{
+	c = c <= 0.0031308f? c * 12.92f: 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+	return (u8) CLAMP(c * 255.0f + 0.5f, 0.0f, 255.0f);
+}
+
+// box filter of the 2x2 texels each one covers, odd edges clamped
+static void downsample(const u8 *src, u32 w, u32 h, u8 *dest)
+{
+	u32 dw = MAX(w / 2, 1u);
+	u32 dh = MAX(h / 2, 1u);
+	for (u32 y = 0; y < dh; y++) {
+		for (u32 x = 0; x < dw; x++) {
+			u32 x0 = MIN(2 * x, w - 1), x1 = MIN(2 * x + 1, w - 1);
+			u32 y0 = MIN(2 * y, h - 1), y1 = MIN(2 * y + 1, h - 1);
+			const u8 *t[4] = {
+				&src[4 * (y0 * w + x0)], &src[4 * (y0 * w + x1)],
+				&src[4 * (y1 * w + x0)], &src[4 * (y1 * w + x1)],
+			};
+			u8 *d = &dest[4 * (y * dw + x)];
+			for (u32 c = 0; c < 3; c++) {
+				float sum = 0.0f;
+				for (u32 i = 0; i < 4; i++) {
+					sum += srgb_linear[t[i][c]];
+				}
+				d[c] = linear_srgb(0.25f * sum);
+			}
+			d[3] = (u8) ((t[0][3] + t[1][3] + t[2][3] + t[3][3] + 2) / 4);
+		}
+	}
+}
+
+// 4x4 blocks left to right and top to bottom, the edges are clamped
+// in the blocks sticking out of the smallest mips
+static void encode_level(const bake_format *fmt, const u8 *src,
+	u32 w, u32 h, u8 *dest)
+{
+	for (u32 by = 0; by < h; by += 4) {
+		for (u32 bx = 0; bx < w; bx += 4) {
+			u8 texel[16][4];
+			for (u32 i = 0; i < 16; i++) {
+				u32 x = MIN(bx + i % 4, w - 1);
+				u32 y = MIN(by + i / 4, h - 1);
+				memcpy(texel[i], &src[4 * (y * w + x)], 4);
+			}
+			fmt->encode((const u8 (*)[4]) texel, dest);
+			dest += fmt->block_size;
+		}
+	}
+}
+
+static u64 align_up(u64 x)
+{
+	return (x + TEXTURE_ALIGN - 1) / TEXTURE_ALIGN * TEXTURE_ALIGN;
+}
+
+static void write_padded(FILE *f, const void *data, u64 size, const char *path)
+{
+	static const u8 zero[TEXTURE_ALIGN] = { 0 };
+	u64 pad = align_up(size) - size;
+	if (fwrite(data, 1, size, f) != size || fwrite(zero, 1, pad, f) != pad)
+		crash("fwrite(\"%s\")", path);
+}
+
+int main(int argc, char **argv)
+{
+	const bake_format *fmt = &FORMATS[0];
+	char **arg = argv + 1;
+	if (argc > 2 && strcmp(*arg, "-f") == 0) {
+		fmt = NULL;
+		for (u32 i = 0; i < ARRAY_SIZE(FORMATS); i++) {
+			if (strcmp(arg[1], FORMATS[i].name) == 0)
+				fmt = &FORMATS[i];
+		}
+		if (!fmt)
+			crash("unknown format %s", arg[1]);
+		arg += 2;
+	}
+	if (argv + argc - arg < 2)
+		crash("usage: %s [-f rgba8|bc1|bc7] out.gtex layer...", argv[0]);
+	const char *out = arg[0];
+	u32 n_layer = (u32) (argv + argc - arg - 1);
+	char **layer_path = arg + 1;
+	srgb_init();
+	loaded_image first = load_image(layer_path[0]);
+	u32 n_mip = mips_for(first.width, first.height);
+	texture_header header = {
+		.magic = TEXTURE_MAGIC,
+		.version = TEXTURE_VERSION,
+		.format = fmt->fmt,
+		.width = first.width,
+		.height = first.height,
+		.n_layer = n_layer,
+		.n_mip = n_mip,
+	};
+	loaded_image_fini(first);
+	float (*average)[4] = xmalloc(n_layer * sizeof(*average));
+	texture_level *level = xmalloc(n_layer * n_mip * sizeof(*level));
+	u64 offset = align_up(sizeof(header) + n_layer * sizeof(*average)
+		+ n_layer * n_mip * sizeof(*level));
+	for (u32 layer = 0; layer < n_layer; layer++) {
+		u32 w = header.width, h = header.height;
+		for (u32 mip = 0; mip < n_mip; mip++) {
+			u64 blocks = (u64) ((w + fmt->block_dim - 1) / fmt->block_dim)
+				* ((h + fmt->block_dim - 1) / fmt->block_dim);
+			u64 size = blocks * fmt->block_size;
+			level[layer * n_mip + mip] = (texture_level){ offset, size, w, h };
+			offset += align_up(size);
+			w = MAX(w / 2, 1u);
+			h = MAX(h / 2, 1u);
+		}
+	}
+	// the tables are written once every average is known
+	char *tmp_path = xmalloc(strlen(out) + 5);
+	sprintf(tmp_path, "%s.tmp", out);
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f)
+		crash("fopen(\"%s\")", tmp_path);
+	if (fseek(f, (long) level[0].offset, SEEK_SET) != 0)
+		crash("fseek(\"%s\")", tmp_path);
+	// the levels are generated alternating between both halves
+	u64 scratch_size = 4ull * MAX(header.width / 2, 1u) * MAX(header.height / 2, 1u);
+	u8 *scratch = xmalloc(2 * scratch_size);
+	u8 *encoded = fmt->encode? xmalloc(level[0].size): NULL;
+	for (u32 layer = 0; layer < n_layer; layer++) {
+		loaded_image img = load_image(layer_path[layer]);
+		if (img.width != header.width || img.height != header.height)
+			crash("%s is %ux%u, the first layer %ux%u", layer_path[layer],
+				img.width, img.height, header.width, header.height);
+		loaded_image_average(img, average[layer]);
+		const u8 *src = img.mem;
+		for (u32 mip = 0; mip < n_mip; mip++) {
+			const texture_level *lvl = &level[layer * n_mip + mip];
+			if (mip > 0) {
+				u8 *dest = scratch + (mip % 2) * scratch_size;
+				downsample(src, lvl[-1].width, lvl[-1].height, dest);
+				src = dest;
+			}
+			if (fmt->encode) {
+				encode_level(fmt, src, lvl->width, lvl->height, encoded);
+				write_padded(f, encoded, lvl->size, tmp_path);
+			} else {
+				write_padded(f, src, lvl->size, tmp_path);
+			}
+		}
+		loaded_image_fini(img);
+		printf("%s: %u %s mips\n", layer_path[layer], n_mip, fmt->name);
+	}
+	rewind(f);
+	write_padded(f, &header, sizeof(header), tmp_path);
+	if (fseek(f, (long) sizeof(header), SEEK_SET) != 0
+	    || fwrite(average, sizeof(*average), n_layer, f) != n_layer
+	    || fwrite(level, sizeof(*level), n_layer * n_mip, f) != n_layer * n_mip)
+		crash("fwrite(\"%s\")", tmp_path);
+	if (fclose(f) != 0)
+		crash("fclose(\"%s\")", tmp_path);
+	if (rename(tmp_path, out) != 0)
+		crash("rename(\"%s\", \"%s\")", tmp_path, out);
+	free(encoded);
+	free(scratch);
+	free(tmp_path);
+	free(level);
+	free(average);
+	return 0;
+}
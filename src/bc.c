@@ -0,0 +1,280 @@
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "bc.h"
+#include "util.h"
+
+
+// endpoints on the principal axis of the first n_chan channels,
+// through the mean and spanning every texel's projection
+static void fit_line(const u8 texel[16][4], u32 n_chan,
+	float e0[4], float e1[4])
+{
+	float mean[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	for (u32 i = 0; i < 16; i++) {
+		for (u32 c = 0; c < n_chan; c++) {
+			mean[c] += (float) texel[i][c] / 16.0f;
+		}
+	}
+	float cov[4][4] = { { 0.0f } };
+	for (u32 i = 0; i < 16; i++) {
+		for (u32 a = 0; a < n_chan; a++) {
+			for (u32 b = 0; b < n_chan; b++) {
+				cov[a][b] += ((float) texel[i][a] - mean[a])
+					* ((float) texel[i][b] - mean[b]);
+			}
+		}
+	}
+	// power iteration from the row of the widest channel,
+	// a few steps are enough for a 4x4 matrix
+	u32 widest = 0;
+	for (u32 c = 1; c < n_chan; c++) {
+		if (cov[c][c] > cov[widest][widest])
+			widest = c;
+	}
+	float axis[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	memcpy(axis, cov[widest], n_chan * sizeof(float));
+	for (u32 iter = 0; iter < 8; iter++) {
+		float next[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		float norm = 0.0f;
+		for (u32 a = 0; a < n_chan; a++) {
+			for (u32 b = 0; b < n_chan; b++) {
+				next[a] += cov[a][b] * axis[b];
+			}
+			norm += next[a] * next[a];
+		}
+		if (norm < 1e-6f)
+			break;
+		for (u32 a = 0; a < n_chan; a++) {
+			axis[a] = next[a] / sqrtf(norm);
+		}
+	}
+	float tmin = 0.0f, tmax = 0.0f;
+	float len = 0.0f;
+	for (u32 c = 0; c < n_chan; c++) {
+		len += axis[c] * axis[c];
+	}
+	for (u32 i = 0; i < 16 && len > 0.0f; i++) {
+		float t = 0.0f;
+		for (u32 c = 0; c < n_chan; c++) {
+			t += ((float) texel[i][c] - mean[c]) * axis[c];
+		}
+		tmin = MIN(tmin, t / len);
+		tmax = MAX(tmax, t / len);
+	}
+	for (u32 c = 0; c < 4; c++) {
+		e0[c] = c < n_chan? CLAMP(mean[c] + tmin * axis[c], 0.0f, 255.0f): 255.0f;
+		e1[c] = c < n_chan? CLAMP(mean[c] + tmax * axis[c], 0.0f, 255.0f): 255.0f;
+	}
+}
+
+// least squares endpoints for the weights the texels were given,
+// false when the weights do not pin them down
+static bool refit_line(const u8 texel[16][4], u32 n_chan,
+	const float w[16], float e0[4], float e1[4])
+{
+	float a = 0.0f, b = 0.0f, c = 0.0f;
+	float r0[4] = { 0.0f }, r1[4] = { 0.0f };
+	for (u32 i = 0; i < 16; i++) {
+		float u = 1.0f - w[i];
+		a += u * u;
+		b += u * w[i];
+		c += w[i] * w[i];
+		for (u32 k = 0; k < n_chan; k++) {
+			r0[k] += u * (float) texel[i][k];
+			r1[k] += w[i] * (float) texel[i][k];
+		}
+	}
+	float det = a * c - b * b;
+	if (fabsf(det) < 1e-4f)
+		return false;
+	for (u32 k = 0; k < n_chan; k++) {
+		e0[k] = CLAMP((c * r0[k] - b * r1[k]) / det, 0.0f, 255.0f);
+		e1[k] = CLAMP((a * r1[k] - b * r0[k]) / det, 0.0f, 255.0f);
+	}
+	return true;
+}
+
+static u32 dist2(const u8 x[4], const u8 y[4], u32 n_chan)
+{
+	u32 d = 0;
+	for (u32 c = 0; c < n_chan; c++) {
+		i32 diff = (i32) x[c] - (i32) y[c];
+		d += (u32) (diff * diff);
+	}
+	return d;
+}
+
+// nearest palette entry of every texel, returns the summed error
+static u32 pick_indices(const u8 texel[16][4], u32 n_chan,
+	const u8 (*palette)[4], u32 n_palette, u8 indx[16])
+{
+	u32 total = 0;
+	for (u32 i = 0; i < 16; i++) {
+		u32 best = UINT32_MAX;
+		for (u32 p = 0; p < n_palette; p++) {
+			u32 d = dist2(texel[i], palette[p], n_chan);
+			if (d < best) {
+				best = d;
+				indx[i] = (u8) p;
+			}
+		}
+		total += best;
+	}
+	return total;
+}
+
+static u16 rgb565(const float e[4])
+{
+	u32 r = (u32) (e[0] * 31.0f / 255.0f + 0.5f);
+	u32 g = (u32) (e[1] * 63.0f / 255.0f + 0.5f);
+	u32 b = (u32) (e[2] * 31.0f / 255.0f + 0.5f);
+	return (u16) (r << 11 | g << 5 | b);
+}
+
+static void rgb565_expand(u16 c, u8 dest[4])
+{
+	u32 r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+	dest[0] = (u8) (r << 3 | r >> 2);
+	dest[1] = (u8) (g << 2 | g >> 4);
+	dest[2] = (u8) (b << 3 | b >> 2);
+	dest[3] = 255;
+}
+
+// weight of c1 in each of the 4 color mode entries
+static const float BC1_WEIGHT[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+// w receives the weight of e1 for every texel
+static u32 bc1_try(const u8 texel[16][4], const float e0[4], const float e1[4],
+	u8 dest[8], float w[16])
+{
+	u16 c0 = rgb565(e0), c1 = rgb565(e1);
+	// the 4 color mode needs the larger endpoint first
+	bool swap = c0 < c1;
+	if (swap) {
+		u16 tmp = c0;
+		c0 = c1;
+		c1 = tmp;
+	}
+	u8 palette[4][4];
+	rgb565_expand(c0, palette[0]);
+	rgb565_expand(c1, palette[1]);
+	for (u32 c = 0; c < 3; c++) {
+		palette[2][c] = (u8) ((2 * palette[0][c] + palette[1][c]) / 3);
+		palette[3][c] = (u8) ((palette[0][c] + 2 * palette[1][c]) / 3);
+	}
+	u8 indx[16];
+	// equal endpoints select the 3 color mode, where only 0 is safe
+	u32 err = pick_indices(texel, 3, (const u8 (*)[4]) palette,
+		c0 == c1? 1: 4, indx);
+	u32 bits = 0;
+	for (u32 i = 0; i < 16; i++) {
+		bits |= (u32) indx[i] << (2 * i);
+		w[i] = swap? 1.0f - BC1_WEIGHT[indx[i]]: BC1_WEIGHT[indx[i]];
+	}
+	u8 block[8] = {
+		(u8) c0, (u8) (c0 >> 8), (u8) c1, (u8) (c1 >> 8),
+		(u8) bits, (u8) (bits >> 8), (u8) (bits >> 16), (u8) (bits >> 24),
+	};
+	memcpy(dest, block, sizeof(block));
+	return err;
+}
+
+void bc1_encode_block(const u8 texel[16][4], u8 dest[8])
+{
+	float e0[4], e1[4], w[16];
+	fit_line(texel, 3, e0, e1);
+	u32 err = bc1_try(texel, e0, e1, dest, w);
+	u8 refined[8];
+	if (refit_line(texel, 3, w, e0, e1)
+	    && bc1_try(texel, e0, e1, refined, w) < err)
+		memcpy(dest, refined, sizeof(refined));
+}
+
+static const u32 BC7_WEIGHT4[16] = {
+	0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64,
+};
+
+// the 7 bit value and p bit nearest to an 8 bit endpoint
+static void bc7_quantize(const float e[4], u8 q[4], u8 *p)
+{
+	float best = INFINITY;
+	for (u32 pbit = 0; pbit < 2; pbit++) {
+		u8 cand[4];
+		float err = 0.0f;
+		for (u32 c = 0; c < 4; c++) {
+			float v = roundf((e[c] - (float) pbit) / 2.0f);
+			cand[c] = (u8) CLAMP(v, 0.0f, 127.0f);
+			float d = (float) (cand[c] << 1 | pbit) - e[c];
+			err += d * d;
+		}
+		if (err < best) {
+			best = err;
+			memcpy(q, cand, sizeof(cand));
+			*p = (u8) pbit;
+		}
+	}
+}
+
+static void bits_put(u8 dest[16], u32 *at, u32 value, u32 n)
+{
+	for (u32 i = 0; i < n; i++, (*at)++) {
+		dest[*at / 8] |= (u8) (((value >> i) & 1) << (*at % 8));
+	}
+}
+
+// w receives the weight of e1 for every texel
+static u32 bc7_try(const u8 texel[16][4], const float e0[4], const float e1[4],
+	u8 dest[16], float w[16])
+{
+	u8 q[2][4], p[2];
+	bc7_quantize(e0, q[0], &p[0]);
+	bc7_quantize(e1, q[1], &p[1]);
+	u8 end[2][4];
+	for (u32 k = 0; k < 2; k++) {
+		for (u32 c = 0; c < 4; c++) {
+			end[k][c] = (u8) (q[k][c] << 1 | p[k]);
+		}
+	}
+	u8 palette[16][4];
+	for (u32 i = 0; i < 16; i++) {
+		for (u32 c = 0; c < 4; c++) {
+			palette[i][c] = (u8) (((64 - BC7_WEIGHT4[i]) * end[0][c]
+				+ BC7_WEIGHT4[i] * end[1][c] + 32) >> 6);
+		}
+	}
+	u8 indx[16];
+	u32 err = pick_indices(texel, 4, (const u8 (*)[4]) palette, 16, indx);
+	// the first index is stored without its top bit
+	bool swap = indx[0] & 8;
+	for (u32 i = 0; i < 16; i++) {
+		w[i] = (float) BC7_WEIGHT4[indx[i]] / 64.0f;
+		if (swap)
+			indx[i] = (u8) (15 - indx[i]);
+	}
+	u32 a = swap? 1: 0, b = 1 - a;
+	memset(dest, 0, 16);
+	u32 at = 0;
+	bits_put(dest, &at, 1 << 6, 7);
+	for (u32 c = 0; c < 4; c++) {
+		bits_put(dest, &at, q[a][c], 7);
+		bits_put(dest, &at, q[b][c], 7);
+	}
+	bits_put(dest, &at, p[a], 1);
+	bits_put(dest, &at, p[b], 1);
+	for (u32 i = 0; i < 16; i++) {
+		bits_put(dest, &at, indx[i], i == 0? 3: 4);
+	}
+	return err;
+}
+
+void bc7_encode_block(const u8 texel[16][4], u8 dest[16])
+{
+	float e0[4], e1[4], w[16];
+	fit_line(texel, 4, e0, e1);
+	u32 err = bc7_try(texel, e0, e1, dest, w);
+	u8 refined[16];
+	if (refit_line(texel, 4, w, e0, e1)
+	    && bc7_try(texel, e0, e1, refined, w) < err)
+		memcpy(dest, refined, sizeof(refined));
+}
@@ -0,0 +1,21 @@
+#version 450
+
+#include "shared.h"
+
+// uniforms
+layout(r32ui, binding = 4) uniform readonly restrict uimage2DArray splat;
+layout(push_constant) uniform draw_data {
+	push_constant_data draw;
+};
+
+// attachments
+layout(location = 0) out vec4 frag_color;
+
+void main()
+{
+	uint acc = imageLoad(splat, ivec3(gl_FragCoord.xy, draw.baseindex)).r;
+	if (acc == 0u) {
+		discard;
+	}
+	frag_color = vec4(splat_color(acc), 0.0);
+}
@@ -0,0 +1,78 @@
+#include <string.h>
+#include <stddef.h>
+#include "downsample.h"
+#include "util.h"
+
+
+// storage images cannot be srgb, the shader encodes them itself
+static VkFormat storage_format(VkFormat fmt)
+{
+	switch (fmt) {
+	case VK_FORMAT_R8G8B8A8_SRGB:
+		return VK_FORMAT_R8G8B8A8_UNORM;
+	case VK_FORMAT_B8G8R8A8_SRGB:
+		return VK_FORMAT_B8G8R8A8_UNORM;
+	default:
+		return fmt;
+	}
+}
+
+downsample_chain downsample_chain_create(context *ctx,
+	vulkan_bound_image *src, u32 src_level, VkImageAspectFlags aspect,
+	vulkan_bound_image *dest, u32 first_level, u32 n_layer)
+{
+	downsample_chain c;
+	c.n_layer = n_layer;
+	c.n_level = first_level < dest->mips? dest->mips - first_level: 0;
+	// a level 0 padded past the source is written whole
+	c.dim.width  = MAX(src->dim.width  >> src_level,
+		2 * MAX(dest->dim.width  >> first_level, 1u));
+	c.dim.height = MAX(src->dim.height >> src_level,
+		2 * MAX(dest->dim.height >> first_level, 1u));
+	// a workgroup covers 64x64 texels and the last one up to 128x128
+	// workgroups
+	if (c.n_level == 0 || c.n_level > DOWNSAMPLE_MAX_LEVELS
+	    || MAX(c.dim.width, c.dim.height) > 2 * 64 * 64)
+		crash("cannot downsample %ux%u into %u levels",
+			c.dim.width, c.dim.height, c.n_level);
+	c.source = vulkan_image_view_create_layers(ctx, src,
+		src_level, src->fmt, aspect);
+	for (u32 k = 0; k < DOWNSAMPLE_MAX_LEVELS; k++) {
+		c.level[k] = (k < c.n_level)?
+			vulkan_image_view_create_layers(ctx, dest, first_level + k,
+				storage_format(dest->fmt), VK_IMAGE_ASPECT_COLOR_BIT):
+			c.level[c.n_level - 1];
+	}
+	c.done = buffer_create(ctx, dest->n_img * sizeof(u32),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	// from then on the last workgroup of a layer resets its count
+	memset(buffer_map(ctx, c.done), 0, c.done.size);
+	buffer_unmap(ctx, c.done);
+	return c;
+}
+
+void downsample_chain_destroy(context *ctx, downsample_chain *c)
+{
+	buffer_destroy(ctx, c->done);
+	for (u32 k = 0; k < c->n_level; k++) {
+		vulkan_image_view_destroy(ctx, c->level[k]);
+	}
+	vulkan_image_view_destroy(ctx, c->source);
+}
+
+void downsample_dispatch(VkCommandBuffer cmd, VkPipelineLayout layout,
+	downsample_chain *c, u32 baseindex)
+{
+	VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT
+		| VK_SHADER_STAGE_VERTEX_BIT
+		| VK_SHADER_STAGE_FRAGMENT_BIT;
+	vkCmdPushConstants(cmd, layout, stages,
+		offsetof(struct push_constant_data, baseindex),
+		sizeof(baseindex), &baseindex);
+	vkCmdPushConstants(cmd, layout, stages,
+		offsetof(struct push_constant_data, downsample_levels),
+		sizeof(c->n_level), &c->n_level);
+	vkCmdDispatch(cmd, (c->dim.width + 63) / 64, (c->dim.height + 63) / 64,
+		c->n_layer);
+}
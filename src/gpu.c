@@ -1,9 +1,11 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
 #include "util.h"
 #include "gpu.h"
+#include "allocator.h"
 
 
 static bool less_bits(u32 a, u32 b)
@@ -11,7 +13,21 @@ static bool less_bits(u32 a, u32 b)
 	return a < b;
 }
 
-static gpu_specs gpu_specs_init(VkPhysicalDevice dev)
+static bool extension_supported(VkPhysicalDevice dev, const char *name)
+{
+	u32 n_dev_ext;
+	vkEnumerateDeviceExtensionProperties(dev, NULL, &n_dev_ext, NULL);
+	VkExtensionProperties *dev_ext = xmalloc(n_dev_ext * sizeof(*dev_ext));
+	vkEnumerateDeviceExtensionProperties(dev, NULL, &n_dev_ext, dev_ext);
+	bool found = false;
+	for (u32 i = 0; i < n_dev_ext && !found; i++) {
+		found = strcmp(name, dev_ext[i].extensionName) == 0;
+	}
+	free(dev_ext);
+	return found;
+}
+
+static gpu_specs gpu_specs_init(VkPhysicalDevice dev, u32 api_version)
 {
 	u32 n_queue_families;
 	vkGetPhysicalDeviceQueueFamilyProperties(dev, &n_queue_families, NULL);
@@ -58,6 +74,44 @@ static gpu_specs gpu_specs_init(VkPhysicalDevice dev)
 	vkGetPhysicalDeviceProperties(dev, &specs->properties);
 	vkGetPhysicalDeviceFeatures(dev, &specs->features);
 	vkGetPhysicalDeviceMemoryProperties(dev, &specs->memory);
+	specs->subgroup_size = 1;
+	specs->subgroup_stages = 0;
+	specs->subgroup_ops = 0;
+	specs->timeline_semaphore = false;
+	specs->timeline_khr = false;
+	// subgroups are core 1.1, both the instance and the device must have it
+	if (api_version >= VK_API_VERSION_1_1
+	    && specs->properties.apiVersion >= VK_API_VERSION_1_1) {
+		VkPhysicalDeviceSubgroupProperties subgroup = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+		};
+		VkPhysicalDeviceProperties2 props = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+			.pNext = &subgroup,
+		};
+		vkGetPhysicalDeviceProperties2(dev, &props);
+		specs->subgroup_size = subgroup.subgroupSize;
+		specs->subgroup_stages = subgroup.supportedStages;
+		specs->subgroup_ops = subgroup.supportedOperations;
+	}
+	// timeline semaphores are core 1.2, an extension of 1.1 devices
+	bool core12 = api_version >= VK_API_VERSION_1_2
+		&& specs->properties.apiVersion >= VK_API_VERSION_1_2;
+	if (api_version >= VK_API_VERSION_1_1
+	    && specs->properties.apiVersion >= VK_API_VERSION_1_1
+	    && (core12 || extension_supported(dev,
+			VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))) {
+		VkPhysicalDeviceTimelineSemaphoreFeatures timeline = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+		};
+		VkPhysicalDeviceFeatures2 features = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+			.pNext = &timeline,
+		};
+		vkGetPhysicalDeviceFeatures2(dev, &features);
+		specs->timeline_semaphore = timeline.timelineSemaphore;
+		specs->timeline_khr = !core12;
+	}
 	return specs;
 }
 
@@ -72,6 +126,11 @@ static u32 gpu_specs_score(gpu_specs specs)
 		return 0;
 	if (!specs->features.multiDrawIndirect)
 		return 0;
+	if (!specs->features.shaderStorageImageArrayDynamicIndexing)
+		return 0;
+	// every submission is paced with them, see sync.h
+	if (!specs->timeline_semaphore)
+		return 0;
 	if (specs->iq_graphics == UINT32_MAX)
 		return 0;
 	if (specs->iq_compute == UINT32_MAX)
@@ -157,7 +216,20 @@ static void vulkan_validation_layers()
 	crash("validation layer '%s' not found");
 }
 
-static VkInstance vulkan_instance()
+// up to 1.2 for timeline semaphores, 1.1 has them as an extension
+static u32 instance_api_version(void)
+{
+	PFN_vkEnumerateInstanceVersion enumerate = (PFN_vkEnumerateInstanceVersion)
+		vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkEnumerateInstanceVersion");
+	u32 version = VK_API_VERSION_1_0;
+	if (enumerate && enumerate(&version) != VK_SUCCESS)
+		version = VK_API_VERSION_1_0;
+	if (version >= VK_API_VERSION_1_2)
+		return VK_API_VERSION_1_2;
+	return version >= VK_API_VERSION_1_1? VK_API_VERSION_1_1: VK_API_VERSION_1_0;
+}
+
+static VkInstance vulkan_instance(u32 api_version)
 {
 	VkApplicationInfo app_desc = {
 		.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
@@ -165,7 +237,7 @@ static VkInstance vulkan_instance()
 		.applicationVersion = VK_MAKE_VERSION(0, 0, 0),
 		.pEngineName = "No engine",
 		.engineVersion = VK_MAKE_VERSION(0, 0, 0),
-		.apiVersion = VK_API_VERSION_1_0,
+		.apiVersion = api_version,
 	};
 	VkInstanceCreateInfo inst_desc = {
 		.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -194,7 +266,7 @@ static const char *extensions[] = {
 	VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 };
 
-static VkPhysicalDevice vulkan_select_gpu(VkInstance inst,
+static VkPhysicalDevice vulkan_select_gpu(VkInstance inst, u32 api_version,
 	VkSurfaceKHR target, gpu_specs *out_specs)
 {
 	VkPhysicalDevice selected = VK_NULL_HANDLE;
@@ -205,7 +277,7 @@ static VkPhysicalDevice vulkan_select_gpu(VkInstance inst,
 	u32 best_score = 0;
 	gpu_specs selected_specs = NULL;
 	for (u32 i = 0; i < n_gpu; i++) {
-		gpu_specs specs = gpu_specs_init(gpu[i]);
+		gpu_specs specs = gpu_specs_init(gpu[i], api_version);
 		u32 specs_score = gpu_specs_score(specs);
 		specs_score &= extension_match(gpu[i],
 			ARRAY_SIZE(extensions), extensions);
@@ -235,28 +307,72 @@ static VkPhysicalDevice vulkan_select_gpu(VkInstance inst,
 	return selected;
 }
 
+// graphics, compute and transfer may all be the same family
+static u32 queue_families_in_use(gpu_specs specs, u32 family[3])
+{
+	u32 wanted[] = {
+		specs->iq_graphics,
+		specs->iq_compute,
+		specs->iq_transfer,
+	};
+	u32 n_family = 0;
+	for (u32 i = 0; i < ARRAY_SIZE(wanted); i++) {
+		bool seen = false;
+		for (u32 j = 0; j < n_family; j++) {
+			seen |= family[j] == wanted[i];
+		}
+		if (!seen)
+			family[n_family++] = wanted[i];
+	}
+	return n_family;
+}
+
 static VkDevice vulkan_logical_device(VkPhysicalDevice physical,
-	gpu_specs specs)
+	u32 n_family, u32 *family, bool indirect_count, bool timeline_khr,
+	bool pipeline_statistics, bool texture_bc)
 {
-	VkDeviceQueueCreateInfo queue_desc[] = {
-		{
+	static const float priority = 1.0f;
+	// one queue per distinct family
+	VkDeviceQueueCreateInfo queue_desc[3];
+	for (u32 i = 0; i < n_family; i++) {
+		queue_desc[i] = (VkDeviceQueueCreateInfo){
 			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-			.queueFamilyIndex = specs->iq_graphics,
+			.queueFamilyIndex = family[i],
 			.queueCount = 1,
-			.pQueuePriorities = (float[]){ 1.0f },
-		},
-	};
+			.pQueuePriorities = &priority,
+		};
+	}
 	VkPhysicalDeviceFeatures features = {
 		.samplerAnisotropy = VK_TRUE,
 		.multiDrawIndirect = VK_TRUE,
+		.shaderStorageImageArrayDynamicIndexing = VK_TRUE,
+		// optional, for the invocation counts of query.c
+		.pipelineStatisticsQuery = pipeline_statistics,
+		// optional, for the block compressed textures of bin/bake
+		.textureCompressionBC = texture_bc,
+	};
+	// required ones first, then the optional ones that are supported
+	const char *enabled[ARRAY_SIZE(extensions) + 2];
+	u32 n_enabled = 0;
+	for (u32 i = 0; i < ARRAY_SIZE(extensions); i++) {
+		enabled[n_enabled++] = extensions[i];
+	}
+	if (indirect_count)
+		enabled[n_enabled++] = VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME;
+	if (timeline_khr)
+		enabled[n_enabled++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+	VkPhysicalDeviceTimelineSemaphoreFeatures timeline = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+		.timelineSemaphore = VK_TRUE,
 	};
 	VkDeviceCreateInfo device_desc = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-		.queueCreateInfoCount = ARRAY_SIZE(queue_desc),
+		.pNext = &timeline,
+		.queueCreateInfoCount = n_family,
 		.pQueueCreateInfos = queue_desc,
 		.pEnabledFeatures = &features,
-		.enabledExtensionCount = ARRAY_SIZE(extensions),
-		.ppEnabledExtensionNames = extensions,
+		.enabledExtensionCount = n_enabled,
+		.ppEnabledExtensionNames = enabled,
 		.enabledLayerCount = 1,
 		.ppEnabledLayerNames = &validation,
 	};
@@ -322,17 +438,127 @@ static VkExtent2D swapchain_select_resolution(context *ctx)
 	}
 }
 
+// next to the binary and the shaders, `make clean` drops it with them
+static const char PIPELINE_CACHE_PATH[] = "bin/pipeline.cache";
+static const u32 PIPELINE_CACHE_MAGIC = 0x6c616761; // "gala"
+
+// written before the driver's blob, whose own header is not trusted to
+// catch a driver update: a cache from another device or driver is dropped
+typedef struct {
+	u32 magic;
+	u32 vendor_id;
+	u32 device_id;
+	u32 driver_version;
+	u8 uuid[VK_UUID_SIZE];
+	u64 size;
+} pipeline_cache_header;
+
+static pipeline_cache_header pipeline_cache_header_of(
+	const VkPhysicalDeviceProperties *prop, u64 size)
+{
+	pipeline_cache_header h = {
+		.magic = PIPELINE_CACHE_MAGIC,
+		.vendor_id = prop->vendorID,
+		.device_id = prop->deviceID,
+		.driver_version = prop->driverVersion,
+		.size = size,
+	};
+	memcpy(h.uuid, prop->pipelineCacheUUID, VK_UUID_SIZE);
+	return h;
+}
+
+// a missing or stale file only costs the compilation it would have saved
+static VkPipelineCache pipeline_cache_load(VkDevice device,
+	const VkPhysicalDeviceProperties *prop)
+{
+	void *data = NULL;
+	size_t size = 0;
+	FILE *f = fopen(PIPELINE_CACHE_PATH, "rb");
+	if (f) {
+		pipeline_cache_header got;
+		if (fread(&got, sizeof(got), 1, f) == 1) {
+			pipeline_cache_header want = pipeline_cache_header_of(prop, got.size);
+			if (memcmp(&got, &want, sizeof(got)) == 0) {
+				size = (size_t) got.size;
+				data = xmalloc(size);
+				if (fread(data, 1, size, f) != size)
+					size = 0;
+			}
+		}
+		fclose(f);
+	}
+	VkPipelineCacheCreateInfo cache_desc = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		.initialDataSize = size,
+		.pInitialData = data,
+	};
+	VkPipelineCache cache;
+	if (vkCreatePipelineCache(device, &cache_desc, NULL, &cache) != VK_SUCCESS)
+		crash("vkCreatePipelineCache");
+	free(data);
+	return cache;
+}
+
+// written aside and renamed so an interrupted save leaves the old cache
+static void pipeline_cache_save(VkDevice device, VkPipelineCache cache,
+	const VkPhysicalDeviceProperties *prop)
+{
+	size_t size;
+	if (vkGetPipelineCacheData(device, cache, &size, NULL) != VK_SUCCESS)
+		return;
+	void *data = xmalloc(size);
+	if (vkGetPipelineCacheData(device, cache, &size, data) == VK_SUCCESS) {
+		char tmp[sizeof(PIPELINE_CACHE_PATH) + 4];
+		snprintf(tmp, sizeof(tmp), "%s.new", PIPELINE_CACHE_PATH);
+		pipeline_cache_header h = pipeline_cache_header_of(prop, size);
+		FILE *f = fopen(tmp, "wb");
+		if (f) {
+			bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+				&& fwrite(data, 1, size, f) == size;
+			ok = fclose(f) == 0 && ok;
+			if (!ok || rename(tmp, PIPELINE_CACHE_PATH) != 0)
+				remove(tmp);
+		}
+	}
+	free(data);
+}
+
 context context_init(int width, int height, const char *title)
 {
 	// TODO: heap allocate
 	context ctx;
 	init_glfw();
 	ctx.window = glfw_window(width, height, title);
-	ctx.vk_instance = vulkan_instance();
+	ctx.api_version = instance_api_version();
+	ctx.vk_instance = vulkan_instance(ctx.api_version);
 	ctx.present_surface.handle = vulkan_surface(ctx.vk_instance, ctx.window);
 	ctx.physical_device = vulkan_select_gpu(
-		ctx.vk_instance, ctx.present_surface.handle, &ctx.specs);
-	ctx.device = vulkan_logical_device(ctx.physical_device, ctx.specs);
+		ctx.vk_instance, ctx.api_version, ctx.present_surface.handle, &ctx.specs);
+	ctx.n_family = queue_families_in_use(ctx.specs, ctx.family);
+	bool indirect_count = extension_supported(ctx.physical_device,
+		VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+	ctx.device = vulkan_logical_device(ctx.physical_device,
+		ctx.n_family, ctx.family, indirect_count, ctx.specs->timeline_khr,
+		ctx.specs->features.pipelineStatisticsQuery,
+		ctx.specs->features.textureCompressionBC);
+	ctx.cmd_draw_indexed_indirect_count = indirect_count?
+		(PFN_vkCmdDrawIndexedIndirectCountKHR) vkGetDeviceProcAddr(ctx.device,
+			"vkCmdDrawIndexedIndirectCountKHR"):
+		NULL;
+	ctx.cmd_draw_indirect_count = indirect_count?
+		(PFN_vkCmdDrawIndirectCountKHR) vkGetDeviceProcAddr(ctx.device,
+			"vkCmdDrawIndirectCountKHR"):
+		NULL;
+	bool khr = ctx.specs->timeline_khr;
+	ctx.wait_semaphores = (PFN_vkWaitSemaphores) vkGetDeviceProcAddr(ctx.device,
+		khr? "vkWaitSemaphoresKHR": "vkWaitSemaphores");
+	ctx.get_semaphore_counter_value = (PFN_vkGetSemaphoreCounterValue)
+		vkGetDeviceProcAddr(ctx.device, khr?
+			"vkGetSemaphoreCounterValueKHR": "vkGetSemaphoreCounterValue");
+	ctx.pipeline_cache = pipeline_cache_load(ctx.device,
+		&ctx.specs->properties);
+	ctx.alloc = device_allocator_create(&ctx.specs->memory,
+		ctx.specs->properties.limits.bufferImageGranularity);
 	ctx.present_surface.fmt = surface_fmt(
 		ctx.physical_device, ctx.present_surface.handle);
 	ctx.present_surface.mode = surface_present_mode(
@@ -349,6 +575,10 @@ context context_init(int width, int height, const char *title)
 
 void context_fini(context *ctx)
 {
+	device_allocator_destroy(ctx);
+	pipeline_cache_save(ctx->device, ctx->pipeline_cache,
+		&ctx->specs->properties);
+	vkDestroyPipelineCache(ctx->device, ctx->pipeline_cache, NULL);
 	gpu_specs_fini(ctx->specs);
 	vkDestroyDevice(ctx->device, NULL);
 	vkDestroySurfaceKHR(ctx->vk_instance, ctx->present_surface.handle, NULL);
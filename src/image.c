@@ -1,14 +1,19 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <stb/stb_image.h>
 #include "image.h"
 #include "util.h"
 #include "lifetime.h"
+#include "trace.h"
 
 
 loaded_image load_image(const char *path)
 {
+	TRACE_ZONE("load_image");
 	int w, h, ch;
 	void *ptr = stbi_load(path, &w, &h, &ch, 4);
 	if (!ptr) crash("stbi_load(\"%s\")", path);
@@ -20,6 +25,28 @@ void loaded_image_fini(loaded_image img)
 	stbi_image_free(img.mem);
 }
 
+// in linear space, as splat_body adds it up, alpha is linear already
+void loaded_image_average(loaded_image img, float dest[4])
+{
+	float linear[256];
+	for (u32 i = 0; i < 256; i++) {
+		float c = (float) i / 255.0f;
+		linear[i] = c <= 0.04045f? c / 12.92f: powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+	const unsigned char *texel = img.mem;
+	double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+	u64 n = (u64) img.width * img.height;
+	for (u64 i = 0; i < n; i++) {
+		for (u32 c = 0; c < 3; c++) {
+			sum[c] += linear[texel[4 * i + c]];
+		}
+		sum[3] += texel[4 * i + 3] / 255.0;
+	}
+	for (u32 c = 0; c < 4; c++) {
+		dest[c] = (float) (sum[c] / (double) n);
+	}
+}
+
 u32 mips_for(u32 width, u32 height)
 {
 	float max_dim = MAX((float) width, (float) height);
@@ -62,18 +89,11 @@ vulkan_bound_image vulkan_bound_image_create(context *ctx,
 		crash("vkCreateImage");
 	VkMemoryRequirements req;
 	vkGetImageMemoryRequirements(ctx->device, handle, &req);
-	extern u32 constrain_memory_type(context*, u32, VkMemoryPropertyFlags);
-	VkMemoryAllocateInfo alloc_desc = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = req.size,
-		.memoryTypeIndex = constrain_memory_type(
-			ctx, req.memoryTypeBits, memory
-		),
-	};
-	VkDeviceMemory mem;
-	if (vkAllocateMemory(ctx->device, &alloc_desc, NULL, &mem) != VK_SUCCESS)
-		crash("vkAllocateMemory");
-	vkBindImageMemory(ctx->device, handle, mem, 0);
+	device_allocation mem = device_alloc(ctx, &req, memory,
+		(desc->tiling == VK_IMAGE_TILING_OPTIMAL)?
+			MEMORY_OPTIMAL:
+			MEMORY_LINEAR);
+	vkBindImageMemory(ctx->device, handle, mem.mem, mem.offset);
 	VkImageView view = vulkan_image_view_create_external(ctx, handle,
 		desc->format, desc->mipLevels, desc->arrayLayers, kind);
 	return (vulkan_bound_image){
@@ -87,7 +107,29 @@ void vulkan_bound_image_destroy(context *ctx, vulkan_bound_image *bnd)
 {
 	vulkan_image_view_destroy(ctx, bnd->view);
 	vkDestroyImage(ctx->device, bnd->handle, NULL);
-	vkFreeMemory(ctx->device, bnd->mem, NULL);
+	device_free(ctx, bnd->mem);
+}
+
+// a single mip of every layer, e.g. to be bound as a storage image,
+// fmt may differ from the image's if it was created mutable
+VkImageView vulkan_image_view_create_layers(context *ctx, vulkan_bound_image *img,
+	u32 level, VkFormat fmt, VkImageAspectFlags kind)
+{
+	VkImageViewCreateInfo desc = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+		.image = img->handle,
+		.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+		.format = fmt,
+		.subresourceRange.aspectMask = kind,
+		.subresourceRange.baseMipLevel = level,
+		.subresourceRange.levelCount = 1,
+		.subresourceRange.baseArrayLayer = 0,
+		.subresourceRange.layerCount = img->n_img,
+	};
+	VkImageView view;
+	if (vkCreateImageView(ctx->device, &desc, NULL, &view) != VK_SUCCESS)
+		crash("vkCreateImageView");
+	return view;
 }
 
 static void image_barrier(VkCommandBuffer cmd, VkImageMemoryBarrier *barrier,
@@ -120,6 +162,9 @@ void vulkan_bound_image_layout_transition(VkCommandBuffer cmd, vulkan_bound_imag
 	} else if (prev == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
 		rel_stg = VK_PIPELINE_STAGE_TRANSFER_BIT;
 		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	} else if (prev == VK_IMAGE_LAYOUT_GENERAL) {
+		rel_stg = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
 	} else {
 		crash("unimplemented image transition source");
 	}
@@ -131,152 +176,232 @@ void vulkan_bound_image_layout_transition(VkCommandBuffer cmd, vulkan_bound_imag
 		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
 	} else if (next == VK_IMAGE_LAYOUT_GENERAL) {
 		acq_stg = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-		barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
 	} else {
 		crash("unimplemented image transition destination");
 	}
 	image_barrier(cmd, &barrier, rel_stg, acq_stg);
 }
 
-void vulkan_bound_image_transfer(VkCommandBuffer cmd, vulkan_buffer buf, vulkan_bound_image *img)
+void vulkan_bound_image_transfer(VkCommandBuffer cmd, vulkan_buffer buf,
+	VkDeviceSize offset, vulkan_bound_image *img, u32 layer)
 {
 	VkBufferImageCopy region = {
-		.bufferOffset = 0,
+		.bufferOffset = offset,
 		.bufferRowLength = 0,
 		.bufferImageHeight = 0,
 		.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
 		.imageSubresource.mipLevel = 0,
-		.imageSubresource.baseArrayLayer = 0,
-		.imageSubresource.layerCount = img->n_img,
+		.imageSubresource.baseArrayLayer = layer,
+		.imageSubresource.layerCount = 1,
 		.imageOffset = {0, 0, 0},
 		.imageExtent = {img->dim.width, img->dim.height, 1},
 	};
 	vkCmdCopyBufferToImage(cmd, buf.handle, img->handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
 }
 
-void vulkan_bound_image_mips_transition(VkCommandBuffer cmd, vulkan_bound_image *img)
+// sampled layers filled through transfers
+vulkan_bound_image vulkan_bound_image_create_layered(context *ctx,
+	VkFormat fmt, u32 width, u32 height, u32 mips, u32 n_img)
 {
-	VkImageMemoryBarrier pre_blit = {
-		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-		.image = img->handle,
-		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-		.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		.subresourceRange.baseArrayLayer = 0,
-		.subresourceRange.layerCount = img->n_img,
-		.subresourceRange.levelCount = 1,
-		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-		.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-		.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-	};
-	VkImageMemoryBarrier post_blit = pre_blit;
-	post_blit.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-	post_blit.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-	post_blit.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-	post_blit.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	VkImageBlit blit_desc = {
-		.srcOffsets[0] = { 0, 0, 0 },
-		.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		.srcSubresource.baseArrayLayer = 0,
-		.srcSubresource.layerCount = img->n_img,
-		.dstOffsets[0] = { 0, 0, 0 },
-		.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		.dstSubresource.baseArrayLayer = 0,
-		.dstSubresource.layerCount = img->n_img,
+	VkImageCreateInfo vimg_desc = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = fmt,
+		.extent = { width, height, 1 },
+		.mipLevels = mips,
+		.arrayLayers = n_img,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT
+		       | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+		       | VK_IMAGE_USAGE_SAMPLED_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 	};
-	i32 mip_w = (i32) img->dim.width;
-	i32 mip_h = (i32) img->dim.height;
-	for (u32 mip = 0; mip < img->mips-1; mip++) {
-		// transition mip into src layout
-		pre_blit.subresourceRange.baseMipLevel = mip;
-		image_barrier(cmd, &pre_blit,
-			VK_PIPELINE_STAGE_TRANSFER_BIT,
-			VK_PIPELINE_STAGE_TRANSFER_BIT);
-		// blit mip into next mip
-		i32 new_mip_w = (mip_w > 1)? mip_w/2: 1;
-		i32 new_mip_h = (mip_h > 1)? mip_h/2: 1;
-		blit_desc.srcOffsets[1] = (VkOffset3D){ mip_w, mip_h, 1 };
-		blit_desc.srcSubresource.mipLevel = mip;
-		blit_desc.dstOffsets[1] = (VkOffset3D){ new_mip_w, new_mip_h, 1 };
-		blit_desc.dstSubresource.mipLevel = mip + 1;
-		vkCmdBlitImage(cmd,
-			img->handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			img->handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			1, &blit_desc, VK_FILTER_LINEAR);
-		// wait and transition mip into final state
-		post_blit.subresourceRange.baseMipLevel = mip;
-		image_barrier(cmd, &post_blit,
-			VK_PIPELINE_STAGE_TRANSFER_BIT,
-			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
-		mip_w = new_mip_w;
-		mip_h = new_mip_h;
-	}
-	// transition last mip into final state
-	post_blit.subresourceRange.baseMipLevel = img->mips - 1;
-	post_blit.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	image_barrier(cmd, &post_blit,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
-		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+	return vulkan_bound_image_create(ctx,
+		&vimg_desc, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		VK_IMAGE_ASPECT_COLOR_BIT);
 }
 
-vulkan_bound_image vulkan_bound_image_upload(context *ctx,
-	u32 n_img, loaded_image *img, lifetime *l)
+// the same with the mips past the first one written by downsample.comp,
+// through views of another format when fmt cannot be a storage image
+vulkan_bound_image vulkan_bound_image_create_generated(context *ctx,
+	VkFormat fmt, u32 width, u32 height, u32 mips, u32 n_img)
 {
-	u32 width = img->width;
-	u32 height = img->height;
-	VkDeviceSize img_size = width * height * 4ul;
-	VkDeviceSize size = img_size * (VkDeviceSize) n_img;
-	vulkan_buffer staging = buffer_create(ctx,
-		size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	void *mapped = buffer_map(ctx, staging);
-	for (u32 i = 0; i < n_img; i++) {
-		assert(img[i].width  == width && img[i].height == height);
-		memcpy((char*) mapped + i * img_size, img[i].mem, img_size);
-		loaded_image_fini(img[i]);
-	}
-	buffer_unmap(ctx, staging);
 	VkImageCreateInfo vimg_desc = {
 		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT
+		       | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT,
 		.imageType = VK_IMAGE_TYPE_2D,
-		.format = VK_FORMAT_R8G8B8A8_SRGB,
-		.extent = { img->width, img->height, 1 },
-		.mipLevels = mips_for(img->width, img->height),
+		.format = fmt,
+		.extent = { width, height, 1 },
+		.mipLevels = mips,
 		.arrayLayers = n_img,
 		.samples = VK_SAMPLE_COUNT_1_BIT,
 		.tiling = VK_IMAGE_TILING_OPTIMAL,
 		.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT
-		       | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+		       | VK_IMAGE_USAGE_STORAGE_BIT
 		       | VK_IMAGE_USAGE_SAMPLED_BIT,
 		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
 		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 	};
-	vulkan_bound_image vimg = vulkan_bound_image_create(ctx,
+	return vulkan_bound_image_create(ctx,
 		&vimg_desc, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		VK_IMAGE_ASPECT_COLOR_BIT);
+}
+
+vulkan_bound_image vulkan_bound_image_upload(context *ctx,
+	u32 n_img, loaded_image *img, lifetime *l)
+{
+	u32 width = img->width;
+	u32 height = img->height;
+	VkDeviceSize img_size = width * height * 4ul;
+	vulkan_bound_image vimg = vulkan_bound_image_create_generated(ctx,
+		VK_FORMAT_R8G8B8A8_SRGB, width, height, mips_for(width, height), n_img);
+	VkCommandBufferBeginInfo cmd_begin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	};
+	u32 icmd = lifetime_acquire(l, ctx);
+	VkCommandBuffer cmd = l->cmd[icmd];
+	vkBeginCommandBuffer(cmd, &cmd_begin);
+	vulkan_bound_image_layout_transition(cmd, &vimg,
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+	for (u32 i = 0; i < n_img; i++) {
+		assert(img[i].width  == width && img[i].height == height);
+		VkDeviceSize offset;
+		void *staged = lifetime_try_stage(l, img_size, &offset);
+		if (!staged) {
+			// submit the layers staged so far so their space can be reclaimed
+			vkEndCommandBuffer(cmd);
+			lifetime_release(l, icmd);
+			staged = lifetime_stage(l, ctx, img_size, &offset);
+			icmd = lifetime_acquire(l, ctx);
+			cmd = l->cmd[icmd];
+			vkBeginCommandBuffer(cmd, &cmd_begin);
+		}
+		memcpy(staged, img[i].mem, img_size);
+		loaded_image_fini(img[i]);
+		vulkan_bound_image_transfer(cmd, l->ring.buf, offset, &vimg, i);
+	}
+	// the owner generates the mips once it acquired the image,
+	// see downsample.h
+	lifetime_hand_image(l, cmd, &vimg, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_ACCESS_TRANSFER_READ_BIT|VK_ACCESS_TRANSFER_WRITE_BIT);
+	vkEndCommandBuffer(cmd);
+	lifetime_release(l, icmd);
+	return vimg;
+}
+
+// a layer for the decode workers, written straight to its staging slice
+typedef struct {
+	const char *path;
+	u32 width;
+	u32 height;
+	unsigned char *staged;
+	float *average; // may be NULL
+} decode_job;
+
+typedef struct {
+	decode_job *job;
+	u32 n_job;
+	atomic_uint next;
+} decode_batch;
+
+static void *decode_worker(void *data)
+{
+	TRACE_ZONE("decode_worker");
+	decode_batch *batch = data;
+	u32 i;
+	while ((i = atomic_fetch_add(&batch->next, 1)) < batch->n_job) {
+		decode_job *job = &batch->job[i];
+		loaded_image img = load_image(job->path);
+		if (img.width != job->width || img.height != job->height)
+			crash("%s is %ux%u, the first layer %ux%u", job->path,
+				img.width, img.height, job->width, job->height);
+		memcpy(job->staged, img.mem, img.width * img.height * 4ul);
+		if (job->average)
+			loaded_image_average(img, job->average);
+		loaded_image_fini(img);
+	}
+	return NULL;
+}
+
+// one worker per core at most, the calling thread being one of them
+static void decode_batch_run(decode_job *job, u32 n_job)
+{
+	decode_batch batch = { .job = job, .n_job = n_job };
+	atomic_init(&batch.next, 0);
+	long n_core = sysconf(_SC_NPROCESSORS_ONLN);
+	u32 n_thread = MIN(n_job, n_core > 0? (u32) n_core: 1u);
+	if (n_thread == 0)
+		return;
+	pthread_t *thread = xmalloc(n_thread * sizeof(*thread));
+	for (u32 i = 1; i < n_thread; i++) {
+		if (pthread_create(&thread[i], NULL, decode_worker, &batch) != 0)
+			crash("pthread_create");
+	}
+	decode_worker(&batch);
+	for (u32 i = 1; i < n_thread; i++) {
+		pthread_join(thread[i], NULL);
+	}
+	free(thread);
+}
+
+// like vulkan_bound_image_upload from image files, without holding them
+// all in memory: the layers fitting in the staging ring are decoded
+// concurrently, each into its own slice, then submitted before the next
+// ones; average receives the mean color of every layer when not NULL
+vulkan_bound_image vulkan_bound_image_decode(context *ctx,
+	u32 n_img, const char *const *path, float (*average)[4], lifetime *l)
+{
+	int w, h, ch;
+	if (!stbi_info(path[0], &w, &h, &ch))
+		crash("stbi_info(\"%s\")", path[0]);
+	u32 width = (u32) w;
+	u32 height = (u32) h;
+	VkDeviceSize img_size = width * height * 4ul;
+	vulkan_bound_image vimg = vulkan_bound_image_create_generated(ctx,
+		VK_FORMAT_R8G8B8A8_SRGB, width, height, mips_for(width, height), n_img);
 	VkCommandBufferBeginInfo cmd_begin = {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
 		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
 	};
-	VkFormatProperties props;
-	vkGetPhysicalDeviceFormatProperties(
-		ctx->physical_device, vimg.fmt, &props);
-	if (!(props.optimalTilingFeatures
-	    & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
-		crash("vkCmdBlitImage not available for mipmap generation");
 	u32 icmd = lifetime_acquire(l, ctx);
 	VkCommandBuffer cmd = l->cmd[icmd];
 	vkBeginCommandBuffer(cmd, &cmd_begin);
 	vulkan_bound_image_layout_transition(cmd, &vimg,
 		VK_IMAGE_LAYOUT_UNDEFINED,
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-	vulkan_bound_image_transfer(cmd, staging, &vimg);
-	vulkan_bound_image_mips_transition(cmd, &vimg);
+	decode_job *job = xmalloc(n_img * sizeof(*job));
+	u32 first = 0; // of the batch
+	for (u32 i = 0; i < n_img; i++) {
+		VkDeviceSize offset;
+		void *staged = lifetime_try_stage(l, img_size, &offset);
+		if (!staged) {
+			// submit the batch so far so its space can be reclaimed
+			decode_batch_run(job + first, i - first);
+			vkEndCommandBuffer(cmd);
+			lifetime_release(l, icmd);
+			staged = lifetime_stage(l, ctx, img_size, &offset);
+			icmd = lifetime_acquire(l, ctx);
+			cmd = l->cmd[icmd];
+			vkBeginCommandBuffer(cmd, &cmd_begin);
+			first = i;
+		}
+		job[i] = (decode_job){ path[i], width, height, staged,
+			average? average[i]: NULL };
+		// only recorded, the batch is decoded before it is submitted
+		vulkan_bound_image_transfer(cmd, l->ring.buf, offset, &vimg, i);
+	}
+	decode_batch_run(job + first, n_img - first);
+	free(job);
+	lifetime_hand_image(l, cmd, &vimg, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_ACCESS_TRANSFER_READ_BIT|VK_ACCESS_TRANSFER_WRITE_BIT);
 	vkEndCommandBuffer(cmd);
 	lifetime_release(l, icmd);
-	lifetime_bind_buffer(l, staging);
 	return vimg;
 }
 
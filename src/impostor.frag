@@ -0,0 +1,64 @@
+#version 450
+
+#include "shared.h"
+
+// uniforms
+layout(binding = 3) uniform sampler2DArray tail;
+layout(binding = 5) uniform sampler2DArray detail;
+layout(std430, binding = 6) readonly restrict buffer residency {
+	texture_residency resident;
+};
+layout(push_constant) uniform draw_data {
+	push_constant_data draw;
+};
+
+// varyings
+layout(location = 0) in vec3 vert_world_pos;
+layout(location = 1) flat in vec4 vert_sphere;
+layout(location = 2) flat in vec4 vert_orient;
+layout(location = 3) flat in float vert_texindex;
+
+// attachments
+layout(location = 0) out vec4 frag_color;
+// the hit is never nearer than the quad, which keeps early depth tests
+layout(depth_less) out float gl_FragDepth;
+
+const float PI = 3.14159265;
+
+void main()
+{
+	vec3 eye = draw.cam_pos.xyz;
+	vec3 dir = normalize(vert_world_pos - eye);
+	vec3 oc = eye - vert_sphere.xyz;
+	float b = dot(dir, oc);
+	float disc = b * b - dot(oc, oc) + vert_sphere.w * vert_sphere.w;
+	if (disc < 0.0) {
+		discard;
+	}
+	vec3 hit = eye + (-b - sqrt(disc)) * dir;
+	vec3 normal = (hit - vert_sphere.xyz) / vert_sphere.w;
+	vec4 clip = draw.viewproj * vec4(hit, 1.0);
+	gl_FragDepth = clip.z / clip.w;
+
+	// same parametrization as uv_sphere, in the body's own frame
+	vec4 inv = vec4(-vert_orient.xyz, vert_orient.w);
+	vec3 local = quat_rotate(inv, normal);
+	vec2 uv = vec2(
+		atan(local.y, local.x) / (2.0 * PI),
+		acos(clamp(local.z, -1.0, 1.0)) / PI);
+	uv.x = fract(uv.x);
+	// the longitude wraps around, its derivatives must not
+	vec2 dx = dFdx(uv);
+	vec2 dy = dFdy(uv);
+	dx.x -= round(dx.x);
+	dy.x -= round(dy.x);
+	uint texindex = uint(vert_texindex + 0.5);
+	vec3 color = texture_streamed(detail, tail, resident.tail_mip,
+		resident.entry[texindex], vec3(uv, texindex), dx, dy).rgb;
+
+	vec3 source = vec3(0.0);
+	vec3 to_light = normalize(source - hit);
+	float diffuse = pow(max(0.0, dot(to_light, normal)), 8.0);
+	float ambient = 0.02f;
+	frag_color = vec4((ambient + diffuse) * color, 1.0);
+}
@@ -0,0 +1,43 @@
+#version 450
+
+#include "shared.h"
+
+// uniforms
+layout(push_constant) uniform info_data {
+	push_constant_data info;
+};
+
+layout(std430, set = 0, binding = 1) readonly restrict buffer orbit_tfm {
+	instance inst[MAX_ITEMS];
+} pull;
+
+layout(std430, set = 0, binding = 2) readonly restrict buffer instance_indices {
+	uint partial[MAX_ITEMS];
+	uint imodel[MAX_ITEMS];
+};
+
+// varyings
+layout(location = 0) out vec3 vert_world_pos;
+layout(location = 1) flat out vec4 vert_sphere;
+layout(location = 2) flat out vec4 vert_orient;
+layout(location = 3) flat out float vert_texindex;
+
+// the quad faces the camera through the point of the sphere nearest to it,
+// the silhouette is narrower than the radius there so it is fully covered
+void main()
+{
+	instance inst = pull.inst[imodel[gl_InstanceIndex]];
+	vec3 center = inst.pos_scale.xyz;
+	float radius = 0.5 * inst.pos_scale.w;
+	vec3 view = normalize(center - info.cam_pos.xyz);
+	vec3 up = (abs(view.z) < 0.999)? vec3(0.0, 0.0, 1.0): vec3(1.0, 0.0, 0.0);
+	vec3 right = normalize(cross(view, up));
+	up = cross(right, view);
+	// the index buffer holds the corners as 0 1 2 2 1 3
+	vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1) * 2.0 - 1.0;
+	vert_world_pos = center + radius * (corner.x * right + corner.y * up - view);
+	vert_sphere = vec4(center, radius);
+	vert_orient = instance_orient(inst);
+	vert_texindex = float(inst.texindex);
+	gl_Position = info.viewproj * vec4(vert_world_pos, 1.0);
+}
@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <assert.h>
 #include "lifetime.h"
 #include "util.h"
 #include "sync.h"
+#include "trace.h"
 
 
 static void buffer_fit(void **mem, u32 size, u32 *cap)
@@ -11,22 +13,37 @@ static void buffer_fit(void **mem, u32 size, u32 *cap)
 	}
 }
 
-lifetime lifetime_init(context *ctx, hw_queue q,
-	VkCommandPoolCreateFlags flags, u32 n_cmd)
+lifetime lifetime_init(context *ctx, hw_queue q, hw_queue owner,
+	VkCommandPoolCreateFlags flags, u32 n_cmd, VkDeviceSize staging)
 {
+	TRACE_ZONE("lifetime_init");
 	lifetime l;
+	l.q = q;
+	l.owner = owner;
 	if (n_cmd > 0) {
-		l.q = q;
 		l.pool = command_pool_create(ctx->device, q, flags);
-		char *mem = xmalloc(n_cmd * (sizeof(VkCommandBuffer) + sizeof(VkFence)));
-		l.cmd = (void*) mem;
-		l.wait = (void*) (mem + n_cmd * sizeof(VkCommandBuffer));
+		char *mem = xmalloc(n_cmd * (sizeof(VkDeviceSize) + sizeof(u64)
+			+ sizeof(VkCommandBuffer) + sizeof(bool)));
+		l.mark = (void*) mem;
+		l.released = (void*) (mem + n_cmd * sizeof(VkDeviceSize));
+		l.cmd = (void*) ((char*) l.released + n_cmd * sizeof(u64));
+		l.busy = (void*) ((char*) l.cmd + n_cmd * sizeof(VkCommandBuffer));
 		command_buffer_create(ctx->device, l.pool, n_cmd, l.cmd);
-		cpu_fence_create(ctx->device, n_cmd, l.wait,
-				VK_FENCE_CREATE_SIGNALED_BIT);
+		l.done = timeline_create(ctx->device);
+		for (u32 i = 0; i < n_cmd; i++) {
+			l.busy[i] = false;
+		}
 	}
 	l.n_cmd = n_cmd;
 	l.i_cmd = 0;
+	if (staging > 0) {
+		assert(n_cmd > 0);
+		l.ring = staging_ring_create(ctx, staging);
+	} else {
+		l.ring.mapped = NULL;
+		l.ring.head = 0;
+		l.ring.tail = 0;
+	}
 
 	l.n_buf = 0;
 	l.c_buf = 1 * sizeof(*l.buf);
@@ -40,22 +57,60 @@ lifetime lifetime_init(context *ctx, hw_queue q,
 	l.c_sm = 1 * sizeof(*l.sm);
 	l.sm = xmalloc(l.c_sm);
 
+	l.n_sem = 0;
+	l.c_sem = 1 * sizeof(*l.sem);
+	l.sem = xmalloc(l.c_sem);
+
+	l.n_acq_buf = 0;
+	l.c_acq_buf = 1 * sizeof(*l.acq_buf);
+	l.acq_buf = xmalloc(l.c_acq_buf);
+
+	l.n_acq_img = 0;
+	l.c_acq_img = 1 * sizeof(*l.acq_img);
+	l.acq_img = xmalloc(l.c_acq_img);
+
 	return l;
 }
 
+// submissions on a queue complete in order, so every byte
+// staged before this one was submitted can be reused as well
+static void lifetime_retire(lifetime *l, context *ctx, u32 icmd)
+{
+	if (!l->busy[icmd])
+		return;
+	timeline_wait(ctx,
+		(timeline_point){ l->done.handle, l->released[icmd] }, UINT64_MAX);
+	l->busy[icmd] = false;
+	l->ring.tail = MAX(l->ring.tail, l->mark[icmd]);
+}
+
+// every submission the timeline already passed, without blocking
+static void lifetime_retire_reached(lifetime *l, context *ctx)
+{
+	u64 reached = timeline_reached(ctx, &l->done);
+	for (u32 i = 0; i < l->n_cmd; i++) {
+		if (l->busy[i] && l->released[i] <= reached) {
+			l->busy[i] = false;
+			l->ring.tail = MAX(l->ring.tail, l->mark[i]);
+		}
+	}
+}
+
 void lifetime_fini(lifetime *l, context *ctx)
 {
+	TRACE_ZONE("lifetime_fini");
+	for (u32 i = 0; i < l->n_cmd; i++) {
+		lifetime_retire(l, ctx, i);
+	}
 	if (l->n_cmd > 0) {
-		cpu_fence_wait_all(ctx->device,
-			l->n_cmd, l->wait, UINT64_MAX);
+		timeline_destroy(ctx->device, &l->done);
 	}
-	for (u32 i = 0; i < l->n_cmd; i++) {
-		vkDestroyFence(ctx->device, l->wait[i], NULL);
+	if (l->ring.mapped) {
+		staging_ring_destroy(ctx, &l->ring);
 	}
 
 	for (u32 i = 0; i < l->n_buf; i++) {
-		vkDestroyBuffer(ctx->device, l->buf[i].handle, NULL);
-		vkFreeMemory(ctx->device, l->buf[i].mem, NULL);
+		buffer_destroy(ctx, l->buf[i]);
 	}
 	free(l->buf);
 	for (u32 i = 0; i < l->n_img; i++) {
@@ -66,17 +121,26 @@ void lifetime_fini(lifetime *l, context *ctx)
 		vkDestroySampler(ctx->device, l->sm[i], NULL);
 	}
 	free(l->sm);
+	for (u32 i = 0; i < l->n_sem; i++) {
+		vkDestroySemaphore(ctx->device, l->sem[i], NULL);
+	}
+	free(l->sem);
+	assert(l->n_acq_buf == 0 && l->n_acq_img == 0);
+	free(l->acq_buf);
+	free(l->acq_img);
+	// blocks emptied by this lifetime go back to the driver together
+	device_allocator_trim(ctx);
 
 	if (l->n_cmd > 0) {
-		free(l->cmd);
+		free(l->mark);
 		vkDestroyCommandPool(ctx->device, l->pool, NULL);
 	}
 }
 
 u32 lifetime_acquire(lifetime *l, context *ctx)
 {
-	VkFence fence = l->wait[l->i_cmd];
-	cpu_fence_wait_one(ctx->device, fence, UINT64_MAX);
+	TRACE_ZONE("lifetime_acquire");
+	lifetime_retire(l, ctx, l->i_cmd);
 	VkCommandBuffer cmd = l->cmd[l->i_cmd];
 	vkResetCommandBuffer(cmd, 0);
 	u32 icmd = l->i_cmd;
@@ -86,12 +150,50 @@ u32 lifetime_acquire(lifetime *l, context *ctx)
 
 void lifetime_release(lifetime *l, u32 icmd)
 {
-	VkSubmitInfo submission = {
-		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-		.commandBufferCount = 1,
-		.pCommandBuffers = &l->cmd[icmd],
-	};
-	vkQueueSubmit(l->q.handle, 1, &submission, l->wait[icmd]);
+	lifetime_release_after(l, icmd, (timeline_point){ VK_NULL_HANDLE, 0 }, 0);
+}
+
+void lifetime_release_after(lifetime *l, u32 icmd,
+	timeline_point wait, VkPipelineStageFlags stage)
+{
+	TRACE_ZONE("lifetime_release");
+	submit_sync sync = { 0 };
+	if (wait.handle != VK_NULL_HANDLE)
+		submit_wait(&sync, wait, stage);
+	timeline_point released = timeline_advance(&l->done);
+	submit_signal(&sync, released);
+	queue_submit(l->q.handle, 1, &l->cmd[icmd], &sync);
+	l->released[icmd] = released.value;
+	l->busy[icmd] = true;
+	l->mark[icmd] = l->ring.head;
+}
+
+void *lifetime_try_stage(lifetime *l, VkDeviceSize size, VkDeviceSize *offset)
+{
+	if (!staging_ring_reserve(&l->ring, size, offset))
+		return NULL;
+	return l->ring.mapped + *offset;
+}
+
+// retires the oldest submissions until the ring has room; space staged
+// but not yet submitted cannot be reclaimed, so callers batching several
+// reservations into one command buffer should use lifetime_try_stage
+void *lifetime_stage(lifetime *l, context *ctx,
+	VkDeviceSize size, VkDeviceSize *offset)
+{
+	TRACE_ZONE("lifetime_stage");
+	void *mapped = lifetime_try_stage(l, size, offset);
+	if (mapped)
+		return mapped;
+	// whatever already completed first, then block on the oldest
+	lifetime_retire_reached(l, ctx);
+	for (u32 i = 0; !(mapped = lifetime_try_stage(l, size, offset)); i++) {
+		if (i == l->n_cmd)
+			crash("staging %zu bytes does not fit in a %zu bytes ring",
+				(size_t) size, (size_t) l->ring.buf.size);
+		lifetime_retire(l, ctx, (l->i_cmd + i) % l->n_cmd);
+	}
+	return mapped;
 }
 
 void lifetime_bind_buffer(lifetime *l, vulkan_buffer buf)
@@ -112,3 +214,87 @@ void lifetime_bind_sampler(lifetime *l, VkSampler sm)
 	l->sm[l->n_sm++] = sm;
 }
 
+void lifetime_bind_semaphore(lifetime *l, VkSemaphore sem)
+{
+	buffer_fit((void**) &l->sem, l->n_sem * sizeof(*l->sem), &l->c_sem);
+	l->sem[l->n_sem++] = sem;
+}
+
+static bool lifetime_crosses_family(lifetime *l)
+{
+	return l->q.family_index != l->owner.family_index;
+}
+
+void lifetime_hand_buffer(lifetime *l, VkCommandBuffer cmd,
+	vulkan_buffer buf, VkAccessFlags access)
+{
+	VkBufferMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = 0,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.buffer = buf.handle,
+		.offset = 0,
+		.size = VK_WHOLE_SIZE,
+	};
+	if (!buf.shared && lifetime_crosses_family(l)) {
+		barrier.srcQueueFamilyIndex = l->q.family_index;
+		barrier.dstQueueFamilyIndex = l->owner.family_index;
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			0, 0, NULL, 1, &barrier, 0, NULL);
+	}
+	barrier.dstAccessMask = access;
+	buffer_fit((void**) &l->acq_buf, l->n_acq_buf * sizeof(*l->acq_buf), &l->c_acq_buf);
+	l->acq_buf[l->n_acq_buf++] = barrier;
+}
+
+void lifetime_hand_image(lifetime *l, VkCommandBuffer cmd,
+	vulkan_bound_image *img, VkImageLayout layout, VkAccessFlags access)
+{
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = 0,
+		.oldLayout = layout,
+		.newLayout = layout,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = img->handle,
+		.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+		.subresourceRange.baseMipLevel = 0,
+		.subresourceRange.levelCount = img->mips,
+		.subresourceRange.baseArrayLayer = 0,
+		.subresourceRange.layerCount = img->n_img,
+	};
+	if (lifetime_crosses_family(l)) {
+		barrier.srcQueueFamilyIndex = l->q.family_index;
+		barrier.dstQueueFamilyIndex = l->owner.family_index;
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			0, 0, NULL, 0, NULL, 1, &barrier);
+	}
+	barrier.dstAccessMask = access;
+	buffer_fit((void**) &l->acq_img, l->n_acq_img * sizeof(*l->acq_img), &l->c_acq_img);
+	l->acq_img[l->n_acq_img++] = barrier;
+}
+
+// cmd must run on the owner queue and its submission must wait on
+// the returned point at VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, which is
+// the last release of l; the timeline is destroyed with l so the
+// waiting submission should be retired before l is
+timeline_point lifetime_handoff(lifetime *l, VkCommandBuffer cmd)
+{
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+		0, 0, NULL,
+		l->n_acq_buf, l->acq_buf,
+		l->n_acq_img, l->acq_img);
+	l->n_acq_buf = 0;
+	l->n_acq_img = 0;
+	return timeline_last(&l->done);
+}
@@ -22,6 +22,12 @@
 #include "hwqueue.h"
 #include "lifetime.h"
 #include "sync.h"
+#include "mesh.h"
+#include "query.h"
+#include "trace.h"
+#include "texture.h"
+#include "stream.h"
+#include "downsample.h"
 
 typedef struct {
 	void *mem;
@@ -127,93 +133,6 @@ VkWriteDescriptorSet unbound_descriptor_config(u32 binding, VkDescriptorType typ
 	};
 }
 
-typedef struct {
-	vec3 position;
-	vec3 normal;
-	vec2 uv;
-} vertex;
-
-typedef struct {
-	vertex *vert;
-	u32 *indx;
-	u32 nvert;
-	u32 nindx;
-} mesh;
-
-u32 uv_sphere_vert_size(u32 nx, u32 ny)
-{
-	u32 nvert_quads = (nx + 1) * ny;
-	u32 nvert = nvert_quads + 2 * nx;
-	return nvert * sizeof(vertex);
-}
-
-u32 uv_sphere_indx_size(u32 nx, u32 ny)
-{
-	u32 nindx = 6 * nx * (ny - 1) + 2 * 3 * nx;
-	return nindx * sizeof(u32);
-}
-
-mesh uv_sphere(u32 nx, u32 ny, float r, vertex *vert, u32 *indx)
-{
-	u32 nvert_quads = (nx + 1) * ny;
-	u32 nvert = nvert_quads + 2 * nx;
-	u32 nindx = 6 * nx * (ny - 1) + 2 * 3 * nx;
-	vertex *vcur = vert;
-	for (u32 iy = 0; iy < ny; iy++) {
-		float angley = (float) M_PI * (float) (iy + 1) / (float) (ny + 1);
-		float rsiny = r * sinf(angley);
-		float rcosy = r * cosf(angley);
-		float iy_ny = (float) (iy + 1) / (float) (ny + 1);
-		for (u32 ix = 0; ix <= nx; ix++) {
-			float anglex = 2.0f * (float) M_PI * (float) ix / (float) nx;
-			vcur->position[0] = rsiny * cosf(anglex);
-			vcur->position[1] = rsiny * sinf(anglex);
-			vcur->position[2] = rcosy;
-			vcur->uv[0] = (float) ix / (float) nx;
-			vcur->uv[1] = iy_ny;
-			vcur++;
-		}
-	}
-	for (u32 ipole = 0; ipole < nx; ipole++) {
-		vert[nvert_quads + ipole].position[0] = 0.0f;
-		vert[nvert_quads + ipole].position[1] = 0.0f;
-		vert[nvert_quads + ipole].position[2] = r;
-		vert[nvert_quads + ipole].uv[0] = ((float) ipole + 0.5f) / (float) nx;
-		vert[nvert_quads + ipole].uv[1] = 0.0f;
-		vert[nvert_quads + ipole + nx].position[0] = 0.0f;
-		vert[nvert_quads + ipole + nx].position[1] = 0.0f;
-		vert[nvert_quads + ipole + nx].position[2] = -r;
-		vert[nvert_quads + ipole + nx].uv[0] = ((float) ipole + 0.5f) / (float) nx;
-		vert[nvert_quads + ipole + nx].uv[1] = 1.0f;
-	}
-	for (vcur = vert; vcur != vert + nvert; vcur++) {
-		glm_normalize_to(vcur->position, vcur->normal);
-	}
-	u32 *icur = indx;
-	u32 ivert = 0;
-	for (u32 irow = 0; irow < ny - 1; irow++) {
-		for (u32 icol = 0; icol < nx; icol++) {
-			*icur++ = ivert;
-			*icur++ = ivert + nx + 1;
-			*icur++ = ivert + nx + 2;
-			*icur++ = ivert;
-			*icur++ = ivert + nx + 2;
-			*icur++ = ivert + 1;
-			ivert++;
-		}
-		ivert++;
-	}
-	for (u32 ipole = 0; ipole < nx; ipole++) {
-		*icur++ = nvert_quads + ipole;
-		*icur++ = ipole;
-		*icur++ = ipole + 1;
-		*icur++ = nvert_quads + ipole + nx;
-		*icur++ = nvert_quads - nx + ipole;
-		*icur++ = nvert_quads - nx + ipole - 1;
-	}
-	return (mesh){ vert, indx, nvert, nindx };
-}
-
 VkShaderStageFlagBits shader_stage_from_name(const char *path)
 {
 	if (strstr(path, ".vert.spv"))
@@ -234,18 +153,25 @@ typedef struct {
 	VkDescriptorSet set[MAX_DESCRIPTOR_SETS];
 } pipeline_layout;
 
-VkDescriptorSetLayoutBinding descset_layout_binding(u32 binding,
-	VkDescriptorType type, VkShaderStageFlags access)
+VkDescriptorSetLayoutBinding descset_layout_binding_array(u32 binding,
+	VkDescriptorType type, u32 count, VkShaderStageFlags access)
 {
 	return (VkDescriptorSetLayoutBinding){
 		.binding = binding,
 		.descriptorType = type,
-		.descriptorCount = 1,
+		.descriptorCount = count,
 		.stageFlags = access,
 	};
 }
 
-// description points to an array of union { VkDescriptorBufferInfo; VkDescriptorImageInfo }*
+VkDescriptorSetLayoutBinding descset_layout_binding(u32 binding,
+	VkDescriptorType type, VkShaderStageFlags access)
+{
+	return descset_layout_binding_array(binding, type, 1, access);
+}
+
+// description points to an array of union { VkDescriptorBufferInfo; VkDescriptorImageInfo }*,
+// each pointing to descriptorCount consecutive infos
 pipeline_layout pipeline_layout_create(VkDevice device, u32 n_set,
 	u32 n_bind, VkDescriptorSetLayoutBinding *bind, void **description,
 	u32 n_poolz, VkDescriptorPoolSize *poolz,
@@ -267,6 +193,7 @@ pipeline_layout pipeline_layout_create(VkDevice device, u32 n_set,
 			write[ibind] = unbound_descriptor_config(bind[ibind].binding,
 				type);
 			write[ibind].dstSet = set[iset];
+			write[ibind].descriptorCount = bind[ibind].descriptorCount;
 			switch (type) {
 			case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
 				write[ibind].pBufferInfo = description[ibind];
@@ -310,9 +237,41 @@ void pipeline_layout_destroy(VkDevice device, pipeline_layout *layout)
 	vkDestroyDescriptorSetLayout(device, layout->descset, NULL);
 }
 
+// the set of downsample.comp for a chain, its source read in source_layout
+pipeline_layout downsample_layout_create(VkDevice device, downsample_chain *c,
+	VkSampler point_sampler, VkImageLayout source_layout,
+	VkPushConstantRange *pushconstant)
+{
+	VkDescriptorSetLayoutBinding bind[] = {
+		descset_layout_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT),
+		descset_layout_binding_array(1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+			DOWNSAMPLE_MAX_LEVELS, VK_SHADER_STAGE_COMPUTE_BIT),
+		descset_layout_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
+	};
+	VkDescriptorPoolSize poolz[] = {
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, DOWNSAMPLE_MAX_LEVELS },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+	};
+	VkDescriptorImageInfo level[DOWNSAMPLE_MAX_LEVELS];
+	for (u32 k = 0; k < DOWNSAMPLE_MAX_LEVELS; k++) {
+		level[k] = (VkDescriptorImageInfo){
+			VK_NULL_HANDLE, c->level[k], VK_IMAGE_LAYOUT_GENERAL
+		};
+	}
+	void *binddesc[] = {
+		&(VkDescriptorImageInfo ){ point_sampler, c->source, source_layout },
+		level,
+		&(VkDescriptorBufferInfo){ c->done.handle, 0, c->done.size },
+	};
+	return pipeline_layout_create(device, 1,
+		ARRAY_SIZE(bind), bind, binddesc,
+		ARRAY_SIZE(poolz), poolz, pushconstant);
+}
+
 void pipeline_stage_desc(VkDevice device,
 	VkPipelineShaderStageCreateInfo *desc, VkShaderModule *module,
-	const char *path)
+	const char *path, const VkSpecializationInfo *spec)
 {
 	*module = build_shader_module(path, device);
 	desc->sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -321,7 +280,7 @@ void pipeline_stage_desc(VkDevice device,
 	desc->stage = shader_stage_from_name(path);
 	desc->module = *module;
 	desc->pName = "main";
-	desc->pSpecializationInfo = NULL;
+	desc->pSpecializationInfo = spec;
 }
 
 void pipeline_vertex_input_desc(VkVertexInputAttributeDescription *desc,
@@ -333,34 +292,45 @@ void pipeline_vertex_input_desc(VkVertexInputAttributeDescription *desc,
 	desc->offset = offset;
 }
 
+typedef enum {
+	GRAPHICS_MESH,      // vertex buffer, depth tested and written
+	GRAPHICS_PULLED,    // the same from the vertex index alone
+	GRAPHICS_IMPOSTOR,  // quads from the vertex index, depth from the fragment
+	GRAPHICS_COMPOSITE, // fullscreen triangle added over the background
+} graphics_kind;
+
 VkPipeline graphics_pipeline_create(const char *vert_path, const char *frag_path,
-	VkDevice logical, VkExtent2D dims, VkRenderPass gpass,
-	pipeline_layout *layout)
+	VkDevice logical, VkPipelineCache cache, VkExtent2D dims, VkRenderPass gpass,
+	pipeline_layout *layout, graphics_kind kind)
 {
+	TRACE_ZONE("graphics_pipeline_create");
 	VkShaderModule shader_module[2];
 	VkPipelineShaderStageCreateInfo stg_desc[2];
-	pipeline_stage_desc(logical, &stg_desc[0], &shader_module[0], vert_path);
-	pipeline_stage_desc(logical, &stg_desc[1], &shader_module[1], frag_path);
+	pipeline_stage_desc(logical, &stg_desc[0], &shader_module[0], vert_path, NULL);
+	pipeline_stage_desc(logical, &stg_desc[1], &shader_module[1], frag_path, NULL);
 	VkPipelineDynamicStateCreateInfo dyn_desc = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
 	};
-	VkVertexInputAttributeDescription attributes[3];
-	pipeline_vertex_input_desc(&attributes[0], 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(vertex, position));
-	pipeline_vertex_input_desc(&attributes[1], 1, VK_FORMAT_R32G32B32_SFLOAT, offsetof(vertex, normal  ));
-	pipeline_vertex_input_desc(&attributes[2], 2, VK_FORMAT_R32G32_SFLOAT   , offsetof(vertex, uv      ));
+	VkVertexInputAttributeDescription attributes[2];
+	pipeline_vertex_input_desc(&attributes[0], 0, VK_FORMAT_R16G16_SNORM, offsetof(packed_vertex, normal));
+	pipeline_vertex_input_desc(&attributes[1], 1, VK_FORMAT_R16G16_UNORM, offsetof(packed_vertex, uv    ));
 	VkPipelineVertexInputStateCreateInfo vert_lyt_desc = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
 		.vertexBindingDescriptionCount = 1,
 		.pVertexBindingDescriptions = (VkVertexInputBindingDescription[]){
 			{
 				.binding = 0,
-				.stride = sizeof(vertex),
+				.stride = sizeof(packed_vertex),
 				.inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
 			},
 		},
 		.vertexAttributeDescriptionCount = ARRAY_SIZE(attributes),
 		.pVertexAttributeDescriptions = attributes,
 	};
+	if (kind != GRAPHICS_MESH) {
+		vert_lyt_desc.vertexBindingDescriptionCount = 0;
+		vert_lyt_desc.vertexAttributeDescriptionCount = 0;
+	}
 	VkPipelineInputAssemblyStateCreateInfo ia_desc = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
 		.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
@@ -393,6 +363,8 @@ VkPipeline graphics_pipeline_create(const char *vert_path, const char *frag_path
 		.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
 		.depthBiasEnable = VK_FALSE,
 	};
+	if (kind == GRAPHICS_IMPOSTOR || kind == GRAPHICS_COMPOSITE)
+		ras_desc.cullMode = VK_CULL_MODE_NONE;
 	VkPipelineMultisampleStateCreateInfo ms_desc = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
 		.sampleShadingEnable = VK_FALSE,
@@ -413,6 +385,18 @@ VkPipeline graphics_pipeline_create(const char *vert_path, const char *frag_path
 				| VK_COLOR_COMPONENT_A_BIT,
 		.blendEnable = VK_FALSE,
 	};
+	if (kind == GRAPHICS_COMPOSITE) {
+		// drawn at the far plane, only where nothing was rasterized
+		ds_desc.depthWriteEnable = VK_FALSE;
+		ds_desc.depthCompareOp = VK_COMPARE_OP_GREATER_OR_EQUAL;
+		blend_attach.blendEnable = VK_TRUE;
+		blend_attach.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+		blend_attach.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+		blend_attach.colorBlendOp = VK_BLEND_OP_ADD;
+		blend_attach.srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+		blend_attach.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		blend_attach.alphaBlendOp = VK_BLEND_OP_ADD;
+	}
 	VkPipelineColorBlendStateCreateInfo blend_global = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
 		.logicOpEnable = VK_FALSE,
@@ -437,7 +421,7 @@ VkPipeline graphics_pipeline_create(const char *vert_path, const char *frag_path
 		.subpass = 0,
 	};
 	VkPipeline gpipe;
-	if (vkCreateGraphicsPipelines(logical, VK_NULL_HANDLE, 1, &gpipe_desc, NULL, &gpipe) != VK_SUCCESS)
+	if (vkCreateGraphicsPipelines(logical, cache, 1, &gpipe_desc, NULL, &gpipe) != VK_SUCCESS)
 		crash("vkCreateGraphicsPipelines");
 
 	vkDestroyShaderModule(logical, shader_module[0], NULL);
@@ -446,24 +430,86 @@ VkPipeline graphics_pipeline_create(const char *vert_path, const char *frag_path
 }
 
 VkPipeline compute_pipeline_create(const char *comp_path, VkDevice device,
-	pipeline_layout *layout)
+	VkPipelineCache cache, pipeline_layout *layout, const VkSpecializationInfo *spec)
 {
+	TRACE_ZONE("compute_pipeline_create");
 	VkShaderModule module;
 	VkPipelineShaderStageCreateInfo stg_desc;
-	pipeline_stage_desc(device, &stg_desc, &module, comp_path);
+	pipeline_stage_desc(device, &stg_desc, &module, comp_path, spec);
 	VkComputePipelineCreateInfo pipe_desc = {
 		.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
 		.stage = stg_desc,
 		.layout = layout->handle,
 	};
 	VkPipeline pipe;
-	if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipe_desc, NULL,
+	if (vkCreateComputePipelines(device, cache, 1, &pipe_desc, NULL,
 		&pipe) != VK_SUCCESS)
 		crash("vkCreateComputePipelines");
 	vkDestroyShaderModule(device, module, NULL);
 	return pipe;
 }
 
+// what the SPEC_* constants of the simulation shaders are set to
+typedef struct {
+	u32 local_size;
+	float tolerance[MAX_LOD - 1];
+} simulation_spec;
+
+static const VkSpecializationMapEntry SIMULATION_SPEC_MAP[] = {
+	{ SPEC_LOCAL_SIZE   , offsetof(simulation_spec, local_size  ), sizeof(u32)   },
+	{ SPEC_TOLERANCE + 0, offsetof(simulation_spec, tolerance[0]), sizeof(float) },
+	{ SPEC_TOLERANCE + 1, offsetof(simulation_spec, tolerance[1]), sizeof(float) },
+	{ SPEC_TOLERANCE + 2, offsetof(simulation_spec, tolerance[2]), sizeof(float) },
+};
+_Static_assert(ARRAY_SIZE(SIMULATION_SPEC_MAP) == MAX_LOD,
+	"one specialization per tolerance and the workgroup size");
+
+typedef struct {
+	VkPipeline propagate;
+	VkPipeline update_models;
+	VkPipeline make_draws;
+	u32 local_size; // dispatches are sized with it
+} simulation_pipelines;
+
+// update_models counts its visible bodies with subgroup ballots,
+// built from the same source with SUBGROUP defined
+static bool subgroup_counting(context *ctx)
+{
+	VkSubgroupFeatureFlags need = VK_SUBGROUP_FEATURE_BASIC_BIT
+				    | VK_SUBGROUP_FEATURE_BALLOT_BIT;
+	return (ctx->specs->subgroup_ops & need) == need
+	    && (ctx->specs->subgroup_stages & VK_SHADER_STAGE_COMPUTE_BIT);
+}
+
+simulation_pipelines simulation_pipelines_create(context *ctx,
+	pipeline_layout *layout, const simulation_spec *spec)
+{
+	VkSpecializationInfo spec_desc = {
+		.mapEntryCount = ARRAY_SIZE(SIMULATION_SPEC_MAP),
+		.pMapEntries = SIMULATION_SPEC_MAP,
+		.dataSize = sizeof(*spec),
+		.pData = spec,
+	};
+	return (simulation_pipelines){
+		compute_pipeline_create("bin/propagate.comp.spv",
+			ctx->device, ctx->pipeline_cache, layout, &spec_desc),
+		compute_pipeline_create(subgroup_counting(ctx)?
+				"bin/update_models.subgroup.comp.spv":
+				"bin/update_models.comp.spv",
+			ctx->device, ctx->pipeline_cache, layout, &spec_desc),
+		compute_pipeline_create("bin/make_draws.comp.spv",
+			ctx->device, ctx->pipeline_cache, layout, &spec_desc),
+		spec->local_size,
+	};
+}
+
+void simulation_pipelines_destroy(VkDevice device, simulation_pipelines *sim)
+{
+	vkDestroyPipeline(device, sim->make_draws, NULL);
+	vkDestroyPipeline(device, sim->update_models, NULL);
+	vkDestroyPipeline(device, sim->propagate, NULL);
+}
+
 void command_buffer_begin(VkCommandBuffer cbuf)
 {
 	VkCommandBufferBeginInfo cmd_desc = {
@@ -511,6 +557,10 @@ typedef struct {
 	float *sortkey;
 	u32 *tex;
 
+	// the uploaded nodes are sorted by depth, level[d] is the
+	// first one at depth d and level[height + 1] is n_orbit,
+	// it outlives orbit_tree_fini to drive the propagation
+	u32 *level;
 	struct orbit_spec *uploading_orbit_specs;
 } orbit_tree;
 
@@ -557,6 +607,7 @@ float rand_vec3_shell(float zmin, float zmax, float rmin, float rmax, vec3 dest)
 
 orbit_tree orbit_tree_init(u32 cnt)
 {
+	TRACE_ZONE("orbit_tree_init");
 	u32 n_orbit = 1 + cnt;
 	char *mem = xmalloc(n_orbit * OT_ALL);
 	mat4 *tfm = (void*) mem;
@@ -574,7 +625,7 @@ orbit_tree orbit_tree_init(u32 cnt)
 	tex[0] = 0;
 	tex[1] = 0;
 	const float PI = (float) M_PI;
-	for (u32 i = 2; i < cnt; i++) {
+	for (u32 i = 2; i < n_orbit; i++) {
 		orbiting *o = &orbit_specs[i];
 		float r = rand_vec3_shell(0.485f * PI, 0.515f * PI, 2.0f, 64.0f, o->offset);
 		worldpos[i][3] = rand_float(1.0f/64.0f, 1.0f/8.0f) * 1.4f;
@@ -596,24 +647,53 @@ orbit_tree orbit_tree_init(u32 cnt)
 		index[i] = i;
 	}
 
+	// counting sort by depth so that each level can be propagated
+	// at once from the already resolved one above it, the root is
+	// its own parent and parents come before their children
+	u32 *depth = xmalloc(2 * n_orbit * sizeof(u32));
+	u32 *rank = depth + n_orbit;
+	u32 height = 0;
+	depth[0] = 0;
+	for (u32 i = 1; i < n_orbit; i++) {
+		assert(orbit_specs[i].parent < i);
+		depth[i] = depth[orbit_specs[i].parent] + 1;
+		height = MAX(height, depth[i]);
+	}
+	u32 *level = xmalloc((height + 2) * sizeof(u32));
+	memset(level, 0, (height + 2) * sizeof(u32));
+	for (u32 i = 0; i < n_orbit; i++) {
+		level[depth[i] + 1]++;
+	}
+	for (u32 d = 0; d <= height; d++) {
+		level[d + 1] += level[d];
+	}
+	for (u32 i = 0; i < n_orbit; i++) {
+		rank[i] = level[depth[i]]++;
+	}
+	// the scatter shifted every start to the next one
+	memmove(level + 1, level, height * sizeof(u32));
+	level[0] = 0;
+
 	struct orbit_spec *upload = xmalloc(sizeof(*upload));
 	for (u32 i = 0; i < n_orbit; i++) {
-		memcpy(upload->startoffset[i], orbit_specs[i].offset, sizeof(vec3));
+		u32 at = rank[i];
+		memcpy(upload->startoffset[at], orbit_specs[i].offset, sizeof(vec3));
 		versor orient;
 		vec3 omega;
 		glm_quat_identity(orient);
 		glm_vec3_scale(orbit_specs[i].axis, 0.5f * orbit_specs[i].speed, omega);
-		memcpy(upload->orbitorient[i], orient, sizeof(versor));
-		memcpy(upload->orbitderiv[i], omega, sizeof(vec3));
-		upload->itemscale[i] = worldpos[i][3];
-		upload->texindex[i] = (float) tex[i];
-		upload->parent[i] = orbit_specs[i].parent;
-		memcpy(upload->selforient[i], selfrot[i][0], sizeof(versor));
-		memcpy(upload->selfderiv[i], selfrot[i][1], sizeof(versor));
+		memcpy(upload->orbitorient[at], orient, sizeof(versor));
+		memcpy(upload->orbitderiv[at], omega, sizeof(vec3));
+		upload->itemscale[at] = worldpos[i][3];
+		upload->texindex[at] = (float) tex[i];
+		upload->parent[at] = rank[orbit_specs[i].parent];
+		memcpy(upload->selforient[at], selfrot[i][0], sizeof(versor));
+		memcpy(upload->selfderiv[at], selfrot[i][1], sizeof(versor));
 	}
+	free(depth);
 
-	return (orbit_tree){ 2, n_orbit, tfm, selfrot,
-		worldpos, orbit_specs, index, sortkey, tex, upload };
+	return (orbit_tree){ height, n_orbit, tfm, selfrot,
+		worldpos, orbit_specs, index, sortkey, tex, level, upload };
 }
 
 void orbit_tree_fini(orbit_tree *tree)
@@ -850,6 +930,11 @@ void camera_update(camera *cam, context *ctx, float dt)
 	);
 }
 
+// nx, ny of each meshed lod, procedural.vert can change them every frame
+static const u32 SPHERE_TESS[IMPOSTOR_LOD][2] = {
+	{ 64, 48 },
+};
+
 void push_constant_populate(struct push_constant_data *pushc, camera *cam,
 	u32 index, float time, float dt, u32 tree_height, u32 tree_n)
 {
@@ -860,6 +945,9 @@ void push_constant_populate(struct push_constant_data *pushc, camera *cam,
 	pushc->dt = dt;
 	pushc->tree_height = tree_height;
 	pushc->tree_n = tree_n;
+	for (u32 lod = 0; lod < IMPOSTOR_LOD; lod++) {
+		pushc->sphere_tess[lod] = SPHERE_TESS[lod][0] | SPHERE_TESS[lod][1] << 16;
+	}
 }
 
 typedef struct {
@@ -868,9 +956,11 @@ typedef struct {
 	u32 *vbase;
 	u32 *ibase;
 	u32 n_mesh;
+	bool pulled; // no vert, see procedural.vert
 } uploaded_mesh;
 
-uploaded_mesh mesh_upload(context *ctx, u32 n_mesh, mesh *m,
+// without vertices when pulled, the impostors do not fetch any either
+uploaded_mesh mesh_upload(context *ctx, u32 n_mesh, mesh *m, bool pulled,
 	lifetime *cpuside, lifetime *gpuside)
 {
 	char *mem = xmalloc((n_mesh + 1) * sizeof(u32) * 2);
@@ -882,15 +972,23 @@ uploaded_mesh mesh_upload(context *ctx, u32 n_mesh, mesh *m,
 		vbase[i + 1] = vbase[i] + m[i].nvert;
 		ibase[i + 1] = ibase[i] + m[i].nindx;
 	}
-	vulkan_buffer vert = data_upload(ctx,
-		vbase[n_mesh] * sizeof(vertex), m[0].vert,
-		cpuside, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-	lifetime_bind_buffer(gpuside, vert);
+	vulkan_buffer vert = { 0 };
+	if (!pulled) {
+		packed_vertex *packed = xmalloc(vbase[n_mesh] * sizeof(packed_vertex));
+		for (u32 i = 0; i < n_mesh; i++) {
+			mesh_pack(&m[i], packed + vbase[i]);
+		}
+		vert = data_upload(ctx,
+			vbase[n_mesh] * sizeof(packed_vertex), packed,
+			cpuside, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+		free(packed);
+		lifetime_bind_buffer(gpuside, vert);
+	}
 	vulkan_buffer indx = data_upload(ctx,
-		ibase[n_mesh] * sizeof(u32), m[0].indx,
+		ibase[n_mesh] * sizeof(u16), m[0].indx,
 		cpuside, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
 	lifetime_bind_buffer(gpuside, indx);
-	return (uploaded_mesh){ vert, indx, vbase, ibase, n_mesh };
+	return (uploaded_mesh){ vert, indx, vbase, ibase, n_mesh, pulled };
 }
 
 // TODO: add element size to buffer and index to this function
@@ -909,44 +1007,87 @@ VkBufferMemoryBarrier barrier_read_after_write(vulkan_buffer buf,
 	};
 }
 
-void draw(context *ctx, attached_swapchain *sc,
-	pipeline_layout *graphics_layout, VkPipeline gpipe,
-	pipeline_layout *compute_layout, VkPipeline cpipe, VkPipeline cmdpipe,
-	uploaded_mesh *mesh, camera *cam,
-	vulkan_buffer instbuf, vulkan_buffer workbuf, vulkan_buffer drawbuf,
-	float dt, orbit_tree *tree, vulkan_bound_image *lastlod)
+// propagate, update_models then make_draws, writing the frame_indx halves
+// of instbuf, workbuf, drawbuf and feedback as well as the frame_indx layer
+// of splat, prof may be NULL
+void record_simulation(VkCommandBuffer cmd, u32 frame_indx,
+	pipeline_layout *compute_layout, simulation_pipelines *sim,
+	struct push_constant_data *pushc, vulkan_buffer workbuf,
+	vulkan_buffer drawbuf, vulkan_buffer feedback, orbit_tree *tree,
+	vulkan_bound_image *splat, gpu_profiler *prof)
 {
-	// cpu wait for current frame to be out of graphics pipeline
-	attached_swapchain_swap_buffers(ctx, sc);
-	float now = (float) glfwGetTime();
-	// render
-	VkCommandBuffer cmd = attached_swapchain_current_graphics_cmd(sc);
-	vkResetCommandBuffer(cmd, 0);
-	command_buffer_begin(cmd);
-	VkClearValue clear[] = {
-		[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}},
-		[1].depthStencil = {0.0f, 0},
+	TRACE_ZONE("record_simulation");
+	// the orbit specs are integrated in place by every frame,
+	// splat is cleared once the composite of its slot is done
+	VkMemoryBarrier prev_frame = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+			       | VK_ACCESS_SHADER_WRITE_BIT
+			       | VK_ACCESS_TRANSFER_WRITE_BIT,
 	};
-	vkCmdClearColorImage(cmd, lastlod->handle, VK_IMAGE_LAYOUT_GENERAL,
-		&clear[0].color, 1, &(VkImageSubresourceRange){
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0, 1, &prev_frame, 0, NULL, 0, NULL);
+	gpu_profiler_begin(prof, cmd, frame_indx, PASS_CLEAR);
+	VkClearColorValue empty = { .uint32 = {0, 0, 0, 0} };
+	vkCmdClearColorImage(cmd, splat->handle, VK_IMAGE_LAYOUT_GENERAL,
+		&empty, 1, &(VkImageSubresourceRange){
 			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
 			.baseMipLevel = 0,
 			.levelCount = 1,
-			.baseArrayLayer = sc->frame_indx,
+			.baseArrayLayer = frame_indx,
 			.layerCount = 1,
 	});
-	struct push_constant_data pushc;
-	push_constant_populate(&pushc, cam, sc->frame_indx,
-		now, dt, tree->height, tree->n_orbit);
+	vkCmdFillBuffer(cmd, drawbuf.handle,
+		frame_indx * sizeof(struct draw_stream), DRAW_STREAM_RESET, 0);
+	vkCmdFillBuffer(cmd, feedback.handle, frame_indx * MAX_TEXTURES * sizeof(u32),
+		MAX_TEXTURES * sizeof(u32), 0);
+	gpu_profiler_end(prof, cmd, frame_indx, PASS_CLEAR);
+	VkMemoryBarrier cleared = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+	};
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &cleared, 0, NULL, 0, NULL);
 	vkCmdPushConstants(cmd, compute_layout->handle,
 		VK_SHADER_STAGE_COMPUTE_BIT |
 		VK_SHADER_STAGE_VERTEX_BIT  |
 		VK_SHADER_STAGE_FRAGMENT_BIT,
-		0, sizeof(pushc), &pushc);
-	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cpipe);
+		0, sizeof(*pushc), pushc);
 	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
 		compute_layout->handle, 0, 1, compute_layout->set, 0, NULL);
-	vkCmdDispatch(cmd, tree->n_orbit / LOCAL_SIZE, 1, 1);
+	// world positions, one depth at a time from the root down
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, sim->propagate);
+	gpu_profiler_begin(prof, cmd, frame_indx, PASS_PROPAGATE);
+	VkMemoryBarrier resolved = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+	};
+	for (u32 d = 0; d <= tree->height; d++) {
+		u32 range[2] = { tree->level[d], tree->level[d + 1] };
+		vkCmdPushConstants(cmd, compute_layout->handle,
+			VK_SHADER_STAGE_COMPUTE_BIT |
+			VK_SHADER_STAGE_VERTEX_BIT  |
+			VK_SHADER_STAGE_FRAGMENT_BIT,
+			offsetof(struct push_constant_data, level_base),
+			sizeof(range), range);
+		vkCmdDispatch(cmd, (range[1] - range[0] + sim->local_size - 1) / sim->local_size, 1, 1);
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 1, &resolved, 0, NULL, 0, NULL);
+	}
+	gpu_profiler_end(prof, cmd, frame_indx, PASS_PROPAGATE);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, sim->update_models);
+	gpu_profiler_begin(prof, cmd, frame_indx, PASS_UPDATE_MODELS);
+	vkCmdDispatch(cmd, tree->n_orbit / sim->local_size, 1, 1);
+	gpu_profiler_end(prof, cmd, frame_indx, PASS_UPDATE_MODELS);
 	VkBufferMemoryBarrier cmd_barrier =
 		barrier_read_after_write(workbuf, VK_ACCESS_SHADER_READ_BIT);
 	vkCmdPipelineBarrier(cmd,
@@ -957,21 +1098,29 @@ void draw(context *ctx, attached_swapchain *sc,
 		1, &cmd_barrier,
 		0, NULL
 	);
-	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cmdpipe);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, sim->make_draws);
+	gpu_profiler_begin(prof, cmd, frame_indx, PASS_MAKE_DRAWS);
 	vkCmdDispatch(cmd, CHUNK_COUNT, 1, 1);
-	VkBufferMemoryBarrier barrier_desc[] = {
-		barrier_read_after_write(instbuf, VK_ACCESS_SHADER_READ_BIT),
-		barrier_read_after_write(workbuf, VK_ACCESS_SHADER_READ_BIT),
-		barrier_read_after_write(drawbuf, VK_ACCESS_INDIRECT_COMMAND_READ_BIT),
-	};
+	gpu_profiler_end(prof, cmd, frame_indx, PASS_MAKE_DRAWS);
+	// read by the cpu once the slot comes around, see texture_stream_update
+	VkBufferMemoryBarrier requested =
+		barrier_read_after_write(feedback, VK_ACCESS_HOST_READ_BIT);
 	vkCmdPipelineBarrier(cmd,
 		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-		VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
-		0,
-		0, NULL,
-		ARRAY_SIZE(barrier_desc), barrier_desc,
-		0, NULL
-	);
+		VK_PIPELINE_STAGE_HOST_BIT,
+		0, 0, NULL, 1, &requested, 0, NULL);
+}
+
+void record_render(context *ctx, VkCommandBuffer cmd, attached_swapchain *sc,
+	pipeline_layout *graphics_layout, VkPipeline gpipe, VkPipeline imppipe,
+	VkPipeline splatpipe, struct push_constant_data *pushc, uploaded_mesh *mesh,
+	vulkan_buffer drawbuf, gpu_profiler *prof)
+{
+	TRACE_ZONE("record_render");
+	VkClearValue clear[] = {
+		[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}},
+		[1].depthStencil = {0.0f, 0},
+	};
 	VkRenderPassBeginInfo pass_desc = {
 		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
 		.renderPass = sc->pass,
@@ -981,50 +1130,338 @@ void draw(context *ctx, attached_swapchain *sc,
 		.clearValueCount = ARRAY_SIZE(clear),
 		.pClearValues = clear,
 	};
+	gpu_profiler_begin(prof, cmd, sc->frame_indx, PASS_RENDER);
 	vkCmdBeginRenderPass(cmd, &pass_desc, VK_SUBPASS_CONTENTS_INLINE);
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, gpipe);
 	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
 		graphics_layout->handle, 0,
 		1, &graphics_layout->set[sc->frame_indx],
 		0, NULL);
-	vkCmdBindIndexBuffer(cmd, mesh->indx.handle, 0, VK_INDEX_TYPE_UINT32);
-	vkCmdBindVertexBuffers(cmd, 0, 1, &mesh->vert.handle, &(VkDeviceSize){0});
-	for (u32 lod = 0; lod < MAX_LOD - 1; lod++) {
-		pushc.lod = lod;
-		vkCmdPushConstants(cmd, graphics_layout->handle,
-			VK_SHADER_STAGE_COMPUTE_BIT |
-			VK_SHADER_STAGE_VERTEX_BIT  |
-			VK_SHADER_STAGE_FRAGMENT_BIT,
-			0, sizeof(pushc), &pushc);
-		vkCmdDrawIndexedIndirect(cmd,
-			drawbuf.handle,
-			(sc->frame_indx * MAX_DRAW_PER_FRAME + lod) * sizeof(VkDrawIndexedIndirectCommand),
-			MAX_DRAW_PER_FRAME / MAX_LOD,
-			MAX_LOD * sizeof(VkDrawIndexedIndirectCommand)
-		);
+	vkCmdBindIndexBuffer(cmd, mesh->indx.handle, 0, VK_INDEX_TYPE_UINT16);
+	if (!mesh->pulled)
+		vkCmdBindVertexBuffers(cmd, 0, 1, &mesh->vert.handle, &(VkDeviceSize){0});
+	vkCmdPushConstants(cmd, graphics_layout->handle,
+		VK_SHADER_STAGE_COMPUTE_BIT |
+		VK_SHADER_STAGE_VERTEX_BIT  |
+		VK_SHADER_STAGE_FRAGMENT_BIT,
+		0, sizeof(*pushc), pushc);
+	// make_draws packed one draw per visible meshed lod,
+	// without a count the draws past it are empty
+	VkDeviceSize stream = sc->frame_indx * sizeof(struct draw_stream);
+	VkDeviceSize draws = stream + offsetof(struct draw_stream, draw);
+	VkDeviceSize pulled = stream + offsetof(struct draw_stream, pulled);
+	if (mesh->pulled && ctx->cmd_draw_indirect_count) {
+		ctx->cmd_draw_indirect_count(cmd,
+			drawbuf.handle, pulled,
+			drawbuf.handle, stream + offsetof(struct draw_stream, count),
+			IMPOSTOR_LOD, sizeof(struct draw_pulled));
+	} else if (mesh->pulled) {
+		vkCmdDrawIndirect(cmd, drawbuf.handle, pulled,
+			IMPOSTOR_LOD, sizeof(struct draw_pulled));
+	} else if (ctx->cmd_draw_indexed_indirect_count) {
+		ctx->cmd_draw_indexed_indirect_count(cmd,
+			drawbuf.handle, draws,
+			drawbuf.handle, stream + offsetof(struct draw_stream, count),
+			IMPOSTOR_LOD, sizeof(struct draw_command));
+	} else {
+		vkCmdDrawIndexedIndirect(cmd, drawbuf.handle, draws,
+			IMPOSTOR_LOD, sizeof(struct draw_command));
 	}
+	// and a single one for every impostor
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, imppipe);
+	vkCmdDrawIndexedIndirect(cmd, drawbuf.handle,
+		draws + IMPOSTOR_LOD * sizeof(struct draw_command),
+		1, sizeof(struct draw_command));
+	// the far bodies update_models accumulated
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, splatpipe);
+	vkCmdDraw(cmd, 3, 1, 0, 0);
 	vkCmdEndRenderPass(cmd);
-	command_buffer_end(cmd);
-	// submitting commands for next frame
-	VkSubmitInfo submission_desc = {
-		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-		.waitSemaphoreCount = 1,
-		.pWaitSemaphores = attached_swapchain_current_present_ready(sc),
-		.pWaitDstStageMask = (VkPipelineStageFlags[]){
-			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-		},
-		.commandBufferCount = 1,
-		.pCommandBuffers = &cmd,
-		.signalSemaphoreCount = 1,
-		.pSignalSemaphores = attached_swapchain_current_render_done(sc),
+	gpu_profiler_end(prof, cmd, sc->frame_indx, PASS_RENDER);
+}
+
+// reduces the depth buffer into the frame_indx layer of the pyramid,
+// the next simulation of that slot culls against it
+void record_pyramid(VkCommandBuffer cmd, attached_swapchain *sc,
+	pipeline_layout *pyramid_layout, VkPipeline pyrpipe,
+	struct push_constant_data *pushc, vulkan_buffer drawbuf, gpu_profiler *prof)
+{
+	TRACE_ZONE("record_pyramid");
+	// the simulation of this frame is done reading the layer
+	// and the camera it was culled with
+	VkMemoryBarrier released = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+			| VK_ACCESS_SHADER_WRITE_BIT
+			| VK_ACCESS_TRANSFER_WRITE_BIT,
+	};
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0, 1, &released, 0, NULL, 0, NULL);
+	gpu_profiler_begin(prof, cmd, sc->frame_indx, PASS_PYRAMID);
+	// the occluder fields end the stream
+	struct draw_stream occluder;
+	memcpy(occluder.occluder_viewproj, pushc->viewproj, sizeof(pushc->viewproj));
+	occluder.occluder_dim[0] = sc->base.dim.width;
+	occluder.occluder_dim[1] = sc->base.dim.height;
+	occluder.occluder_valid = 1;
+	occluder.occluder_pad = 0;
+	VkDeviceSize first = offsetof(struct draw_stream, occluder_viewproj);
+	vkCmdUpdateBuffer(cmd, drawbuf.handle,
+		sc->frame_indx * sizeof(occluder) + first,
+		sizeof(occluder) - first, (char*) &occluder + first);
+	VkMemoryBarrier updated = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
 	};
-	if (vkQueueSubmit(sc->graphics_queue.handle, 1, &submission_desc,
-		attached_swapchain_current_rendering(sc)) != VK_SUCCESS)
-		crash("vkQueueSubmit");
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &updated, 0, NULL, 0, NULL);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pyrpipe);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+		pyramid_layout->handle, 0, 1, pyramid_layout->set, 0, NULL);
+	downsample_dispatch(cmd, pyramid_layout->handle,
+		&sc->pyramid_chain, sc->frame_indx);
+	gpu_profiler_end(prof, cmd, sc->frame_indx, PASS_PYRAMID);
+}
+
+void draw(context *ctx, attached_swapchain *sc,
+	pipeline_layout *graphics_layout, VkPipeline gpipe, VkPipeline imppipe,
+	VkPipeline splatpipe, pipeline_layout *compute_layout, simulation_pipelines *sim,
+	pipeline_layout *pyramid_layout, VkPipeline pyrpipe,
+	uploaded_mesh *mesh, camera *cam,
+	vulkan_buffer instbuf, vulkan_buffer workbuf, vulkan_buffer drawbuf,
+	float dt, orbit_tree *tree, vulkan_bound_image *splat,
+	texture_stream *stream, gpu_profiler *prof)
+{
+	// cpu wait for current frame to be out of graphics pipeline,
+	// which also waited for the simulation of that frame
+	attached_swapchain_swap_buffers(ctx, sc);
+	// so the queries of that frame can be read back without waiting
+	if (prof)
+		gpu_profiler_collect(ctx, prof, sc->frame_indx);
+	float now = (float) glfwGetTime();
+	struct push_constant_data pushc;
+	push_constant_populate(&pushc, cam, sc->frame_indx,
+		now, dt, tree->height, tree->n_orbit);
+	VkCommandBuffer cmd = attached_swapchain_current_graphics_cmd(sc);
+	vkResetCommandBuffer(cmd, 0);
+	command_buffer_begin(cmd);
+	// the simulation the graphics of this slot waited for is done
+	// as well, its feedback picks what is streamed before rendering
+	texture_stream_update(stream, cmd, sc->frame_indx);
+	submit_sync render_sync = { 0 };
+	submit_wait(&render_sync,
+		(timeline_point){ *attached_swapchain_current_present_ready(sc), 0 },
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+	if (sc->async_compute) {
+		// simulate this frame on the compute queue while the
+		// graphics queue may still be rasterizing the previous one
+		VkCommandBuffer ccmd = attached_swapchain_current_compute_cmd(sc);
+		vkResetCommandBuffer(ccmd, 0);
+		command_buffer_begin(ccmd);
+		record_simulation(ccmd, sc->frame_indx,
+			compute_layout, sim, &pushc, workbuf, drawbuf,
+			stream->feedback, tree, splat, prof);
+		command_buffer_end(ccmd);
+		// the pyramid of this slot comes from the graphics queue
+		// as well as the composite reading splat
+		submit_sync compute_sync = { 0 };
+		submit_wait(&compute_sync, attached_swapchain_current_rendered(sc),
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+			| VK_PIPELINE_STAGE_TRANSFER_BIT);
+		timeline_point simulated = timeline_advance(&sc->compute_timeline);
+		submit_signal(&compute_sync, simulated);
+		queue_submit(sc->compute_queue.handle, 1, &ccmd, &compute_sync);
+		submit_wait(&render_sync, simulated,
+			VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT
+			| VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+			| VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+			| VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	} else {
+		record_simulation(cmd, sc->frame_indx,
+			compute_layout, sim, &pushc, workbuf, drawbuf,
+			stream->feedback, tree, splat, prof);
+		VkBufferMemoryBarrier barrier_desc[] = {
+			barrier_read_after_write(instbuf, VK_ACCESS_SHADER_READ_BIT),
+			barrier_read_after_write(workbuf, VK_ACCESS_SHADER_READ_BIT),
+			barrier_read_after_write(drawbuf, VK_ACCESS_INDIRECT_COMMAND_READ_BIT),
+		};
+		VkImageMemoryBarrier splatted = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+			.oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+			.newLayout = VK_IMAGE_LAYOUT_GENERAL,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = splat->handle,
+			.subresourceRange = {
+				VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, sc->frame_indx, 1
+			},
+		};
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+			| VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT
+			| VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			0,
+			0, NULL,
+			ARRAY_SIZE(barrier_desc), barrier_desc,
+			1, &splatted
+		);
+	}
+	record_render(ctx, cmd, sc, graphics_layout, gpipe, imppipe, splatpipe,
+		&pushc, mesh, drawbuf, prof);
+	record_pyramid(cmd, sc, pyramid_layout, pyrpipe, &pushc, drawbuf, prof);
+	command_buffer_end(cmd);
+	// the timeline value also tells the next simulation of
+	// this slot that its pyramid is done
+	submit_signal(&render_sync,
+		(timeline_point){ *attached_swapchain_current_render_done(sc), 0 });
+	submit_signal(&render_sync, attached_swapchain_advance_rendered(sc));
+	queue_submit(sc->graphics_queue.handle, 1, &cmd, &render_sync);
 	// present rendered image
 	attached_swapchain_present(sc);
 }
 
+// workgroup sizes timed by simulation_autotune, all divide ITEM_PER_CHUNK
+static const u32 AUTOTUNE_LOCAL_SIZES[] = { 32, 64, 128, 256 };
+enum { AUTOTUNE_RUNS = 8 };
+
+// simulates the current slot AUTOTUNE_RUNS times per workgroup size and
+// keeps the pipelines of the fastest run, the first frame redoes the
+// slot anyway; without timestamps on the queue spec is kept as it is
+simulation_pipelines simulation_autotune(context *ctx, attached_swapchain *sc,
+	pipeline_layout *compute_layout, simulation_spec spec, camera *cam,
+	vulkan_buffer workbuf, vulkan_buffer drawbuf, vulkan_buffer feedback,
+	orbit_tree *tree, vulkan_bound_image *splat)
+{
+	hw_queue queue = sc->async_compute? sc->compute_queue: sc->graphics_queue;
+	u32 valid_bits = ctx->specs->queue_families[queue.family_index].timestampValidBits;
+	if (valid_bits == 0)
+		return simulation_pipelines_create(ctx, compute_layout, &spec);
+	u64 mask = valid_bits == 64? UINT64_MAX: (1ull << valid_bits) - 1;
+	VkPhysicalDeviceLimits *limits = &ctx->specs->properties.limits;
+	struct push_constant_data pushc;
+	push_constant_populate(&pushc, cam, sc->frame_indx,
+		(float) glfwGetTime(), 0.0f, tree->height, tree->n_orbit);
+	VkCommandPool pool = command_pool_create(ctx->device, queue, 0);
+	VkCommandBuffer cmd;
+	command_buffer_create(ctx->device, pool, 1, &cmd);
+	VkQueryPoolCreateInfo query_desc = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = 2 * AUTOTUNE_RUNS,
+	};
+	VkQueryPool queries;
+	if (vkCreateQueryPool(ctx->device, &query_desc, NULL, &queries) != VK_SUCCESS)
+		crash("vkCreateQueryPool");
+	timeline done = timeline_create(ctx->device);
+	simulation_pipelines best = { 0 };
+	double best_ms = INFINITY;
+	for (u32 i = 0; i < ARRAY_SIZE(AUTOTUNE_LOCAL_SIZES); i++) {
+		spec.local_size = AUTOTUNE_LOCAL_SIZES[i];
+		if (spec.local_size > limits->maxComputeWorkGroupInvocations
+		    || spec.local_size > limits->maxComputeWorkGroupSize[0])
+			continue;
+		simulation_pipelines sim = simulation_pipelines_create(ctx,
+			compute_layout, &spec);
+		vkResetCommandPool(ctx->device, pool, 0);
+		command_buffer_begin(cmd);
+		vkCmdResetQueryPool(cmd, queries, 0, 2 * AUTOTUNE_RUNS);
+		for (u32 run = 0; run < AUTOTUNE_RUNS; run++) {
+			vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+				queries, 2 * run);
+			record_simulation(cmd, sc->frame_indx, compute_layout, &sim,
+				&pushc, workbuf, drawbuf, feedback, tree, splat, NULL);
+			vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+				queries, 2 * run + 1);
+		}
+		command_buffer_end(cmd);
+		submit_sync timed = { 0 };
+		timeline_point finished = timeline_advance(&done);
+		submit_signal(&timed, finished);
+		queue_submit(queue.handle, 1, &cmd, &timed);
+		timeline_wait(ctx, finished, UINT64_MAX);
+		u64 stamp[2 * AUTOTUNE_RUNS];
+		if (vkGetQueryPoolResults(ctx->device, queries, 0, 2 * AUTOTUNE_RUNS,
+			sizeof(stamp), stamp, sizeof(*stamp),
+			VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS)
+			crash("vkGetQueryPoolResults");
+		// the first runs may still be warming up, the fastest one counts
+		u64 fastest = UINT64_MAX;
+		for (u32 run = 0; run < AUTOTUNE_RUNS; run++) {
+			fastest = MIN(fastest, (stamp[2 * run + 1] - stamp[2 * run]) & mask);
+		}
+		double ms = (double) fastest * (double) limits->timestampPeriod * 1e-6;
+		printf("simulation with %u invocations per workgroup: %.3fms\n",
+			spec.local_size, ms);
+		if (ms < best_ms) {
+			if (best_ms != INFINITY)
+				simulation_pipelines_destroy(ctx->device, &best);
+			best = sim;
+			best_ms = ms;
+		} else {
+			simulation_pipelines_destroy(ctx->device, &sim);
+		}
+	}
+	timeline_destroy(ctx->device, &done);
+	vkDestroyQueryPool(ctx->device, queries, NULL);
+	vkDestroyCommandPool(ctx->device, pool, NULL);
+	if (best_ms == INFINITY)
+		crash("no workgroup size fits the device limits");
+	return best;
+}
+
+// the body textures and their mips, baked by make in each of
+// TEXTURE_FORMATS, by order of preference
+static VkFormat TEXTURE_FORMATS[] = {
+	VK_FORMAT_BC7_SRGB_BLOCK,
+	VK_FORMAT_BC1_RGB_SRGB_BLOCK,
+	VK_FORMAT_R8G8B8A8_SRGB,
+};
+static const char *const TEXTURES_BAKED[] = {
+	"bin/textures.bc7.gtex",
+	"bin/textures.bc1.gtex",
+	"bin/textures.gtex",
+};
+
+// the first of TEXTURES_BAKED the device can sample, skipping missing
+// and stale files; the compressed formats need textureCompressionBC
+bool baked_textures_open(context *ctx, u32 n_layer, texture_file *dest)
+{
+	// only the last one is not block compressed
+	u32 first = ctx->specs->features.textureCompressionBC?
+		0: (u32) ARRAY_SIZE(TEXTURE_FORMATS) - 1;
+	while (first < ARRAY_SIZE(TEXTURE_FORMATS)) {
+		VkFormat fmt = constrain_format(ctx->physical_device,
+			(u32) ARRAY_SIZE(TEXTURE_FORMATS) - first, TEXTURE_FORMATS + first,
+			VK_IMAGE_TILING_OPTIMAL,
+			VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT
+			| VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+		while (first < ARRAY_SIZE(TEXTURE_FORMATS) && TEXTURE_FORMATS[first] != fmt) {
+			first++;
+		}
+		if (first == ARRAY_SIZE(TEXTURE_FORMATS))
+			break;
+		const char *path = TEXTURES_BAKED[first++];
+		if (!texture_file_open(path, dest))
+			continue;
+		if (dest->header->n_layer == n_layer && dest->header->format == (u32) fmt) {
+			printf("textures from %s\n", path);
+			return true;
+		}
+		printf("%s is stale\n", path);
+		texture_file_close(dest);
+	}
+	printf("no baked textures, decoding them\n");
+	return false;
+}
+
 VkSampler sampler_create(context *ctx)
 {
 	VkPhysicalDeviceProperties *props = &ctx->specs->properties;
@@ -1036,7 +1473,9 @@ VkSampler sampler_create(context *ctx)
 		.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
 		.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
 		.anisotropyEnable = VK_TRUE,
-		.maxAnisotropy = props->limits.maxSamplerAnisotropy,
+		// texture_streamed picks its levels knowing as much
+		.maxAnisotropy = MIN((float)TEXTURE_ANISOTROPY,
+			props->limits.maxSamplerAnisotropy),
 		.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
 		.unnormalizedCoordinates = VK_FALSE,
 		.compareEnable = VK_FALSE,
@@ -1051,175 +1490,333 @@ VkSampler sampler_create(context *ctx)
 	return sm;
 }
 
+// for texelFetch only, which ignores filtering
+VkSampler point_sampler_create(context *ctx)
+{
+	VkSamplerCreateInfo sm_desc = {
+		.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+		.magFilter = VK_FILTER_NEAREST,
+		.minFilter = VK_FILTER_NEAREST,
+		.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.anisotropyEnable = VK_FALSE,
+		.unnormalizedCoordinates = VK_FALSE,
+		.compareEnable = VK_FALSE,
+		.compareOp = VK_COMPARE_OP_ALWAYS,
+		.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+		.minLod = 0.0f,
+		.maxLod = VK_LOD_CLAMP_NONE,
+	};
+	VkSampler sm;
+	if (vkCreateSampler(ctx->device, &sm_desc, NULL, &sm) != VK_SUCCESS)
+		crash("vkCreateSampler");
+	return sm;
+}
+
 static const int WIDTH = 1600;
 static const int HEIGHT = 900;
+// baked textures stream their levels finer than the first one this wide,
+// within TEXTURE_BUDGET bytes of detail layers and TEXTURE_UPLOAD_BUDGET
+// bytes copied per frame
+static const u32 TEXTURE_TAIL_WIDTH = 256;
+static const VkDeviceSize TEXTURE_BUDGET = 24 << 20;
+static const VkDeviceSize TEXTURE_UPLOAD_BUDGET = 1 << 20;
+// must hold the biggest single upload, the orbit specs
+static const VkDeviceSize LOADING_STAGING = 64 << 20;
+// simulate on the compute queue, overlapping the previous frame's rendering
+static const bool ASYNC_COMPUTE = true;
+// build the meshed spheres in procedural.vert instead of fetching vertices,
+// saves the vertex buffer but its non-indexed draws shade every corner
+// once per triangle, without the post-transform cache of the indexed ones
+static const bool VERTEX_PULLING = false;
+// fetched meshes only, a cube sphere has fewer and more even triangles
+static const bool CUBE_SPHERE = false;
+// post-transform cache entries assumed by the mesh report
+static const u32 ACMR_CACHE = 16;
+// the shared.h defaults, the workgroup size may be overridden by AUTOTUNE
+static const simulation_spec SIMULATION_SPEC = {
+	LOCAL_SIZE, { 5e2f, 2e3f, 8e4f },
+};
+// time the simulation with each of AUTOTUNE_LOCAL_SIZES at startup
+static const bool AUTOTUNE = false;
+// time every pass on the gpu, reported on exit
+static const bool PROFILE = false;
 
 int main()
 {
 	context ctx = context_init(WIDTH, HEIGHT, "Gala");
-	attached_swapchain sc = attached_swapchain_create(&ctx);
-	lifetime window_lifetime = lifetime_init(&ctx, sc.graphics_queue, 0, 0);
-	lifetime loading_lifetime = lifetime_init(&ctx, sc.graphics_queue,
+	attached_swapchain sc = attached_swapchain_create(&ctx, ASYNC_COMPUTE);
+	lifetime window_lifetime = lifetime_init(&ctx,
+		sc.graphics_queue, sc.graphics_queue, 0, 0, 0);
+	// uploads run on the dedicated transfer queue when there is one
+	// and are handed over to the graphics queue by setup_lifetime
+	hw_queue transfer_queue = hw_queue_ref(&ctx, ctx.specs->iq_transfer);
+	lifetime loading_lifetime = lifetime_init(&ctx,
+		transfer_queue, sc.graphics_queue,
 		VK_COMMAND_POOL_CREATE_TRANSIENT_BIT
-		| VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, 4);
-	loaded_image images[] = {
-		load_image("res/2k_sun.jpg"),
-		load_image("res/2k_ceres_fictional.jpg"),
-		load_image("res/2k_eris_fictional.jpg"),
-		load_image("res/2k_haumea_fictional.jpg"),
-		load_image("res/2k_jupiter.jpg"),
-		load_image("res/2k_makemake_fictional.jpg"),
-		load_image("res/2k_mars.jpg"),
-		load_image("res/2k_mercury.jpg"),
-		load_image("res/2k_moon.jpg"),
-		load_image("res/2k_neptune.jpg"),
-		load_image("res/2k_saturn.jpg"),
-		load_image("res/2k_uranus.jpg"),
-		load_image("res/2k_venus_surface.jpg"),
+		| VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, 4, LOADING_STAGING);
+	static const char *const textures_path[] = {
+		"res/2k_sun.jpg",
+		"res/2k_ceres_fictional.jpg",
+		"res/2k_eris_fictional.jpg",
+		"res/2k_haumea_fictional.jpg",
+		"res/2k_jupiter.jpg",
+		"res/2k_makemake_fictional.jpg",
+		"res/2k_mars.jpg",
+		"res/2k_mercury.jpg",
+		"res/2k_moon.jpg",
+		"res/2k_neptune.jpg",
+		"res/2k_saturn.jpg",
+		"res/2k_uranus.jpg",
+		"res/2k_venus_surface.jpg",
 	};
-	vulkan_bound_image textures = vulkan_bound_image_upload(&ctx,
-		ARRAY_SIZE(images), images, &loading_lifetime);
-	lifetime_bind_image(&window_lifetime, textures);
+	assert(ARRAY_SIZE(textures_path) <= MAX_TEXTURES);
+	// what a body looks like once it is smaller than a pixel
+	vec4 palette[ARRAY_SIZE(textures_path)];
+	// make bakes them with their mips, which are streamed from the file,
+	// decoding is the fallback and keeps them all resident
+	texture_file baked;
+	bool prebaked = baked_textures_open(&ctx, ARRAY_SIZE(textures_path), &baked);
+	texture_stream stream;
+	if (prebaked) {
+		for (u32 i = 0; i < ARRAY_SIZE(textures_path); i++) {
+			memcpy(palette[i], baked.average[i], sizeof(baked.average[i]));
+		}
+		stream = texture_stream_create(&ctx, &baked, TEXTURE_TAIL_WIDTH,
+			TEXTURE_BUDGET, TEXTURE_UPLOAD_BUDGET, &loading_lifetime);
+	} else {
+		stream = texture_stream_resident(&ctx, vulkan_bound_image_decode(&ctx,
+			ARRAY_SIZE(textures_path), textures_path, palette, &loading_lifetime));
+	}
 	VkSampler sampler = sampler_create(&ctx);
 	lifetime_bind_sampler(&window_lifetime, sampler);
-	u32 vertsz = uv_sphere_vert_size(64, 48) + uv_sphere_vert_size(16, 12)
-		   + uv_sphere_vert_size( 8,  4) + uv_sphere_vert_size( 3,  2);
-	u32 indxsz = uv_sphere_indx_size(64, 48) + uv_sphere_indx_size(16, 12)
-		   + uv_sphere_indx_size( 8,  4) + uv_sphere_indx_size( 3,  2);
+	VkSampler point_sampler = point_sampler_create(&ctx);
+	lifetime_bind_sampler(&window_lifetime, point_sampler);
+	u32 cube_n = SPHERE_TESS[0][0] / 4;
+	u32 vertsz = CUBE_SPHERE ? cube_sphere_vert_size(cube_n)
+		: uv_sphere_vert_size(SPHERE_TESS[0][0], SPHERE_TESS[0][1]);
+	u32 indxsz = (CUBE_SPHERE ? cube_sphere_indx_size(cube_n)
+		: uv_sphere_indx_size(SPHERE_TESS[0][0], SPHERE_TESS[0][1]))
+		   + (u32) (6 * sizeof(u16));
 	char *mesh_storage = xmalloc(vertsz + indxsz);
 	char *mesh_indx = mesh_storage + vertsz;
-	mesh m[4];
-	m[0] = uv_sphere(64, 48, 0.5f, (void*) mesh_storage, (void*) mesh_indx);
-	m[1] = uv_sphere(16, 12, 0.5f, m[0].vert + m[0].nvert, m[0].indx + m[0].nindx);
-	m[2] = uv_sphere( 8,  4, 0.5f, m[1].vert + m[1].nvert, m[1].indx + m[1].nindx);
-	m[3] = uv_sphere( 3,  2, 0.5f, m[2].vert + m[2].nvert, m[2].indx + m[2].nindx);
+	mesh m[IMPOSTOR_LOD + 1];
+	m[0] = CUBE_SPHERE ? cube_sphere(cube_n, 0.5f,
+			(void*) mesh_storage, (void*) mesh_indx)
+		: uv_sphere(SPHERE_TESS[0][0], SPHERE_TESS[0][1], 0.5f,
+			(void*) mesh_storage, (void*) mesh_indx);
+	for (u32 lod = 0; lod < IMPOSTOR_LOD; lod++) {
+		// before the next mesh is placed, fetch order may drop vertices
+		float acmr = mesh_acmr(&m[lod], ACMR_CACHE);
+		mesh_optimize_cache(&m[lod]);
+		mesh_optimize_fetch(&m[lod]);
+		printf("lod %u: %u vertices, %u triangles, acmr %.3f -> %.3f\n",
+			lod, m[lod].nvert, m[lod].nindx / 3,
+			(double) acmr, (double) mesh_acmr(&m[lod], ACMR_CACHE));
+	}
+	m[1] = impostor_quad(m[0].vert + m[0].nvert, m[0].indx + m[0].nindx);
 	// MUST BE CONTIGUOUS
-	uploaded_mesh lods = mesh_upload(&ctx, ARRAY_SIZE(m), m,
+	uploaded_mesh lods = mesh_upload(&ctx, ARRAY_SIZE(m), m, VERTEX_PULLING,
 		&loading_lifetime, &window_lifetime);
 	free(mesh_storage);
 	orbit_tree tree = orbit_tree_init(MAX_ITEMS_PER_FRAME - 1);
 	assert(tree.n_orbit < MAX_ITEMS);
-	vulkan_buffer orbit_spec = data_upload(&ctx,
+	// everything the simulation touches is shared with the compute queue
+	vulkan_buffer orbit_spec = (ASYNC_COMPUTE? data_upload_shared: data_upload)(&ctx,
 		sizeof(struct orbit_spec), tree.uploading_orbit_specs,
 		&loading_lifetime, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 	lifetime_bind_buffer(&window_lifetime, orbit_spec);
-	vulkan_buffer instbuf = buffer_create(&ctx,
-		MAX_ITEMS * sizeof(mat4),
+	vulkan_buffer instbuf = (ASYNC_COMPUTE? buffer_create_shared: buffer_create)(&ctx,
+		MAX_ITEMS * sizeof(struct instance),
 		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	lifetime_bind_buffer(&window_lifetime, instbuf);
-	VkDrawIndexedIndirectCommand *drawmapped =
-		xmalloc(MAX_DRAW * sizeof(*drawmapped));
-
-	for (u32 i = 0, iframe = 0; iframe < MAX_FRAMES_RENDERING; iframe++) {
-		for (u32 ichunk = 0; ichunk < MAX_DRAW_PER_FRAME / MAX_LOD; ichunk++) {
-			for (u32 ilod = 0; ilod < MAX_LOD; ilod++) {
-				drawmapped[i].indexCount =
-					lods.ibase[ilod+1] - lods.ibase[ilod];
-				drawmapped[i].instanceCount = 0;
-				drawmapped[i].firstIndex = lods.ibase[ilod];
-				drawmapped[i].vertexOffset = (i32) lods.vbase[ilod];
-				drawmapped[i].firstInstance = 0;
-				i++;
-			}
+	struct draw_stream *streams = xmalloc(MAX_FRAMES_RENDERING * sizeof(*streams));
+	memset(streams, 0, MAX_FRAMES_RENDERING * sizeof(*streams));
+	for (u32 iframe = 0; iframe < MAX_FRAMES_RENDERING; iframe++) {
+		for (u32 ilod = 0; ilod <= IMPOSTOR_LOD; ilod++) {
+			struct draw_command *m = &streams[iframe].mesh[ilod];
+			m->indexCount = lods.ibase[ilod+1] - lods.ibase[ilod];
+			m->firstIndex = lods.ibase[ilod];
+			m->vertexOffset = (i32) lods.vbase[ilod];
 		}
+		// the quad corners are the raw vertex indices
+		streams[iframe].mesh[IMPOSTOR_LOD].vertexOffset = 0;
 	}
 
-	vulkan_buffer drawbuf = data_upload(&ctx,
-		MAX_DRAW * sizeof(*drawmapped), drawmapped,
+	vulkan_buffer drawbuf = (ASYNC_COMPUTE? data_upload_shared: data_upload)(&ctx,
+		MAX_FRAMES_RENDERING * sizeof(*streams), streams,
 		&loading_lifetime,
 		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-	free(drawmapped);
+	free(streams);
 	lifetime_bind_buffer(&window_lifetime, drawbuf);
-	vulkan_buffer workbuf = buffer_create(&ctx, 2 * MAX_ITEMS * sizeof(u32),
+	vulkan_buffer workbuf = (ASYNC_COMPUTE? buffer_create_shared: buffer_create)(&ctx,
+		2 * MAX_ITEMS * sizeof(u32),
 		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	lifetime_bind_buffer(&window_lifetime, workbuf);
-	VkImageCreateInfo lastlod_desc = {
+	// only ever touched by the simulation queue
+	vulkan_buffer worldbuf = buffer_create(&ctx,
+		MAX_ITEMS_PER_FRAME * sizeof(vec4),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	lifetime_bind_buffer(&window_lifetime, worldbuf);
+	vulkan_buffer palettebuf = (ASYNC_COMPUTE? data_upload_shared: data_upload)(&ctx,
+		sizeof(palette), palette,
+		&loading_lifetime, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	lifetime_bind_buffer(&window_lifetime, palettebuf);
+	// far bodies accumulated at screen resolution, one layer per frame slot
+	VkImageCreateInfo splat_desc = {
 		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
 		.imageType = VK_IMAGE_TYPE_2D,
-		.format = VK_FORMAT_R8_UINT,
-		.extent = (VkExtent3D){ 320, 180, 1 },
+		.format = VK_FORMAT_R32_UINT,
+		.extent = (VkExtent3D){ sc.base.dim.width, sc.base.dim.height, 1 },
 		.mipLevels = 1,
 		.arrayLayers = MAX_FRAMES_RENDERING,
 		.samples = VK_SAMPLE_COUNT_1_BIT,
 		.tiling = VK_IMAGE_TILING_OPTIMAL,
 		.usage = VK_IMAGE_USAGE_STORAGE_BIT
-		       | VK_IMAGE_USAGE_SAMPLED_BIT
 		       | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-		.queueFamilyIndexCount = 1,
-		.pQueueFamilyIndices = &sc.graphics_queue.family_index,
+		.sharingMode = (ASYNC_COMPUTE && ctx.n_family > 1)?
+			VK_SHARING_MODE_CONCURRENT:
+			VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = ctx.n_family,
+		.pQueueFamilyIndices = ctx.family,
 		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 	};
-	vulkan_bound_image lastlod = vulkan_bound_image_create(&ctx, &lastlod_desc,
+	vulkan_bound_image splat = vulkan_bound_image_create(&ctx, &splat_desc,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
-	lifetime_bind_image(&window_lifetime, lastlod);
-	u32 icmd = lifetime_acquire(&loading_lifetime, &ctx);
-	VkCommandBuffer cmd = loading_lifetime.cmd[icmd];
+	lifetime_bind_image(&window_lifetime, splat);
+	VkPushConstantRange pushc_desc = {
+		.stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+			    | VK_SHADER_STAGE_FRAGMENT_BIT
+			    | VK_SHADER_STAGE_COMPUTE_BIT,
+		.offset = 0,
+		.size = sizeof(struct push_constant_data),
+	};
+	// decoded textures only have their first mip, the others are
+	// reduced from it by the setup submission
+	downsample_chain mips = { 0 };
+	pipeline_layout mips_layout = { 0 };
+	VkPipeline mipspipe = VK_NULL_HANDLE;
+	if (!prebaked) {
+		mips = downsample_chain_create(&ctx, &stream.tail, 0,
+			VK_IMAGE_ASPECT_COLOR_BIT, &stream.tail, 1, stream.tail.n_img);
+		mips_layout = downsample_layout_create(ctx.device, &mips,
+			point_sampler, VK_IMAGE_LAYOUT_GENERAL, &pushc_desc);
+		mipspipe = compute_pipeline_create("bin/downsample.comp.spv",
+			ctx.device, ctx.pipeline_cache, &mips_layout, NULL);
+	}
+	lifetime setup_lifetime = lifetime_init(&ctx,
+		sc.graphics_queue, sc.graphics_queue,
+		VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, 1, 0);
+	u32 icmd = lifetime_acquire(&setup_lifetime, &ctx);
+	VkCommandBuffer cmd = setup_lifetime.cmd[icmd];
 	VkCommandBufferBeginInfo begin_desc = {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
 		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
 	};
 	vkBeginCommandBuffer(cmd, &begin_desc);
-	vulkan_bound_image_layout_transition(cmd, &lastlod,
+	timeline_point uploaded = lifetime_handoff(&loading_lifetime, cmd);
+	if (prebaked) {
+		texture_stream_layout_init(&stream, cmd);
+	} else {
+		vulkan_bound_image_layout_transition(cmd, &stream.tail,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mipspipe);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+			mips_layout.handle, 0, 1, mips_layout.set, 0, NULL);
+		downsample_dispatch(cmd, mips_layout.handle, &mips, 0);
+		vulkan_bound_image_layout_transition(cmd, &stream.tail,
+			VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	}
+	vulkan_bound_image_layout_transition(cmd, &splat,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+	vulkan_bound_image_layout_transition(cmd, &sc.depth_pyramid,
 		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
 	vkEndCommandBuffer(cmd);
-	lifetime_release(&loading_lifetime, icmd);
+	lifetime_release_after(&setup_lifetime, icmd,
+		uploaded, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 	VkDescriptorSetLayoutBinding graphics_bind[] = {
 		descset_layout_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT),
 		descset_layout_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT),
 		descset_layout_binding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT),
+		descset_layout_binding(4, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_FRAGMENT_BIT),
+		descset_layout_binding(5, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT),
+		descset_layout_binding(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT),
 	};
 	VkDescriptorPoolSize graphics_poolz[] = {
-		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_FRAMES_RENDERING },
-		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * MAX_FRAMES_RENDERING },
-	};
-	VkPushConstantRange pushc_desc = {
-		.stageFlags = VK_SHADER_STAGE_VERTEX_BIT
-			    | VK_SHADER_STAGE_FRAGMENT_BIT
-			    | VK_SHADER_STAGE_COMPUTE_BIT,
-		.offset = 0,
-		.size = sizeof(struct push_constant_data),
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 * MAX_FRAMES_RENDERING },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3 * MAX_FRAMES_RENDERING },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, MAX_FRAMES_RENDERING },
 	};
 	void *graphics_binddesc[] = {
 		&(VkDescriptorBufferInfo){ instbuf.handle, 0, instbuf.size },
 		&(VkDescriptorBufferInfo){ workbuf.handle, 0, workbuf.size },
-		&(VkDescriptorImageInfo ){ sampler, textures.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+		&(VkDescriptorImageInfo ){ sampler, stream.tail.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+		&(VkDescriptorImageInfo ){ VK_NULL_HANDLE, splat.view, VK_IMAGE_LAYOUT_GENERAL },
+		&(VkDescriptorImageInfo ){ sampler, stream.detail.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+		&(VkDescriptorBufferInfo){ stream.residency.handle, 0, stream.residency.size },
 	};
 	pipeline_layout graphics_layout = pipeline_layout_create(ctx.device, MAX_FRAMES_RENDERING,
 		ARRAY_SIZE(graphics_bind), graphics_bind, graphics_binddesc,
 		ARRAY_SIZE(graphics_poolz), graphics_poolz,
 		&pushc_desc);
-	VkPipeline gpipe = graphics_pipeline_create("bin/shader.vert.spv", "bin/shader.frag.spv",
-		ctx.device, sc.base.dim, sc.pass, &graphics_layout);
+	VkPipeline gpipe = VERTEX_PULLING?
+		graphics_pipeline_create("bin/procedural.vert.spv", "bin/shader.frag.spv",
+			ctx.device, ctx.pipeline_cache, sc.base.dim, sc.pass, &graphics_layout, GRAPHICS_PULLED):
+		graphics_pipeline_create("bin/shader.vert.spv", "bin/shader.frag.spv",
+			ctx.device, ctx.pipeline_cache, sc.base.dim, sc.pass, &graphics_layout, GRAPHICS_MESH);
+	VkPipeline imppipe = graphics_pipeline_create("bin/impostor.vert.spv", "bin/impostor.frag.spv",
+		ctx.device, ctx.pipeline_cache, sc.base.dim, sc.pass, &graphics_layout, GRAPHICS_IMPOSTOR);
+	VkPipeline splatpipe = graphics_pipeline_create("bin/composite.vert.spv", "bin/composite.frag.spv",
+		ctx.device, ctx.pipeline_cache, sc.base.dim, sc.pass, &graphics_layout, GRAPHICS_COMPOSITE);
 	VkDescriptorSetLayoutBinding compute_bind[] = {
 		descset_layout_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
 		descset_layout_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
 		descset_layout_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
 		descset_layout_binding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
 		descset_layout_binding(4, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE , VK_SHADER_STAGE_COMPUTE_BIT),
+		descset_layout_binding(5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
+		descset_layout_binding(6, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT),
+		descset_layout_binding(7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
+		descset_layout_binding(8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
 	};
 	VkDescriptorPoolSize compute_poolz[] = {
-		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7 },
 		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE , MAX_FRAMES_RENDERING },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 },
 	};
 	void *compute_binddesc[] = {
 		&(VkDescriptorBufferInfo){ orbit_spec.handle, 0, orbit_spec.size },
 		&(VkDescriptorBufferInfo){ instbuf   .handle, 0, instbuf   .size },
 		&(VkDescriptorBufferInfo){ workbuf   .handle, 0, workbuf   .size },
 		&(VkDescriptorBufferInfo){ drawbuf   .handle, 0, drawbuf   .size },
-		&(VkDescriptorImageInfo ){ VK_NULL_HANDLE, lastlod.view, VK_IMAGE_LAYOUT_GENERAL },
+		&(VkDescriptorImageInfo ){ VK_NULL_HANDLE, splat.view, VK_IMAGE_LAYOUT_GENERAL },
+		&(VkDescriptorBufferInfo){ worldbuf  .handle, 0, worldbuf  .size },
+		&(VkDescriptorImageInfo ){ point_sampler, sc.depth_pyramid.view, VK_IMAGE_LAYOUT_GENERAL },
+		&(VkDescriptorBufferInfo){ palettebuf.handle, 0, palettebuf.size },
+		&(VkDescriptorBufferInfo){ stream.feedback.handle, 0, stream.feedback.size },
 	};
 	pipeline_layout compute_layout = pipeline_layout_create(ctx.device, 1,
 		ARRAY_SIZE(compute_bind), compute_bind, compute_binddesc,
 		ARRAY_SIZE(compute_poolz), compute_poolz,
 		&pushc_desc);
-	VkPipeline cpipe = compute_pipeline_create("bin/update_models.comp.spv",
-		ctx.device, &compute_layout);
-	VkPipeline cmdpipe = compute_pipeline_create("bin/make_draws.comp.spv",
-		ctx.device, &compute_layout);
+	pipeline_layout pyramid_layout = downsample_layout_create(ctx.device,
+		&sc.pyramid_chain, point_sampler,
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, &pushc_desc);
+	VkPipeline pyrpipe = compute_pipeline_create("bin/downsample.farthest.comp.spv",
+		ctx.device, ctx.pipeline_cache, &pyramid_layout, NULL);
+	// the setup submission waits on a semaphore owned by loading_lifetime,
+	// waiting for it also orders it before the first compute submission
+	lifetime_fini(&setup_lifetime, &ctx);
 	lifetime_fini(&loading_lifetime, &ctx);
+	if (!prebaked) {
+		vkDestroyPipeline(ctx.device, mipspipe, NULL);
+		pipeline_layout_destroy(ctx.device, &mips_layout);
+		downsample_chain_destroy(&ctx, &mips);
+	}
 	orbit_tree_fini(&tree);
 	free(lods.vbase);
 
@@ -1229,32 +1826,68 @@ int main()
 		(vec3){ 0.0f, 0.0f, 0.0f },
 		ctx.window
 	);
+	camera_matrix(&cam);
+	simulation_spec spec = SIMULATION_SPEC;
+	simulation_pipelines sim = AUTOTUNE?
+		simulation_autotune(&ctx, &sc, &compute_layout, spec, &cam,
+			workbuf, drawbuf, stream.feedback, &tree, &splat):
+		simulation_pipelines_create(&ctx, &compute_layout, &spec);
+	// the compute queue is only used, and set, with async compute
+	u32 timed_family[] = {
+		sc.graphics_queue.family_index, sc.compute_queue.family_index,
+	};
+	gpu_profiler prof = { 0 }; // without query pools unless PROFILE
+	if (PROFILE)
+		prof = gpu_profiler_create(&ctx, sc.async_compute? 2: 1, timed_family);
 	context_ignore_mouse_once(&ctx);
 	while (context_keep(&ctx)) {
+		TRACE_ZONE("frame");
 		double beg_time = glfwGetTime();
 		camera_update(&cam, &ctx, dt);
 		camera_matrix(&cam);
 		draw(&ctx, &sc,
-			&graphics_layout, gpipe,
-			&compute_layout, cpipe, cmdpipe,
+			&graphics_layout, gpipe, imppipe, splatpipe,
+			&compute_layout, &sim,
+			&pyramid_layout, pyrpipe,
 			&lods, &cam,
 			instbuf, workbuf, drawbuf,
-			dt, &tree, &lastlod);
+			dt, &tree, &splat, &stream, PROFILE? &prof: NULL);
 		double end_time = glfwGetTime();
 		printf("\rframe time: %.2fms", (end_time - beg_time) * 1e3);
 		dt = (float) (end_time - beg_time);
 	}
 	printf("\n");
 	vkDeviceWaitIdle(ctx.device);
+	for (u32 pass = 0; PROFILE && pass < PASS_COUNT; pass++) {
+		gpu_pass_report r = gpu_profiler_report(&prof, pass);
+		printf("%-14s %3u frames, mean %.3fms p50 %.3fms p95 %.3fms p99 %.3fms, "
+			"invocations vs %" PRIu64 " fs %" PRIu64 " cs %" PRIu64 "\n",
+			gpu_pass_name(pass), r.samples, r.mean_ms, r.p50_ms, r.p95_ms,
+			r.p99_ms, r.vertex_invocations, r.fragment_invocations,
+			r.compute_invocations);
+	}
+	gpu_profiler_destroy(&ctx, &prof);
+	if (prebaked) {
+		printf("streamed %.1fMiB of texture levels\n",
+			(double) stream.uploaded / (1 << 20));
+	}
+	texture_stream_destroy(&ctx, &stream);
+	if (prebaked)
+		texture_file_close(&baked);
 
-	vkDestroyPipeline(ctx.device, cmdpipe, NULL);
-	vkDestroyPipeline(ctx.device, cpipe, NULL);
+	vkDestroyPipeline(ctx.device, pyrpipe, NULL);
+	pipeline_layout_destroy(ctx.device, &pyramid_layout);
+	simulation_pipelines_destroy(ctx.device, &sim);
 	pipeline_layout_destroy(ctx.device, &compute_layout);
+	vkDestroyPipeline(ctx.device, splatpipe, NULL);
+	vkDestroyPipeline(ctx.device, imppipe, NULL);
 	vkDestroyPipeline(ctx.device, gpipe, NULL);
 	pipeline_layout_destroy(ctx.device, &graphics_layout);
 	lifetime_fini(&window_lifetime, &ctx);
+	free(tree.level);
 	attached_swapchain_destroy(&ctx, &sc);
 	context_fini(&ctx);
+	TRACE_DUMP("bin/trace.json");
 	return 0;
 }
 
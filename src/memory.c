@@ -1,4 +1,5 @@
 #include <string.h>
+#include <assert.h>
 #include "memory.h"
 #include "util.h"
 #include "lifetime.h"
@@ -17,50 +18,120 @@ u32 constrain_memory_type(context *ctx, u32 allowed, VkMemoryPropertyFlags cons)
 	crash("no suitable memory type available");
 }
 
-vulkan_buffer buffer_create(context *ctx,
-	VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags cons)
+static vulkan_buffer buffer_create_mode(context *ctx, VkDeviceSize size,
+	VkBufferUsageFlags usage, VkMemoryPropertyFlags cons, bool shared)
 {
+	shared = shared && ctx->n_family > 1;
 	VkBufferCreateInfo buf_desc = {
 		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
 		.size = size,
 		.usage = usage,
-		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.sharingMode = shared?
+			VK_SHARING_MODE_CONCURRENT:
+			VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = shared? ctx->n_family: 0,
+		.pQueueFamilyIndices = ctx->family,
 	};
 	VkBuffer buf;
 	if (vkCreateBuffer(ctx->device, &buf_desc, NULL, &buf) != VK_SUCCESS)
 		crash("vkCreateBuffer");
 	VkMemoryRequirements reqs;
 	vkGetBufferMemoryRequirements(ctx->device, buf, &reqs);
-	VkMemoryAllocateInfo mem_desc = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = reqs.size,
-		.memoryTypeIndex = constrain_memory_type(
-			ctx,
-			reqs.memoryTypeBits,
-			cons
-		),
-	};
-	VkDeviceMemory mem;
-	if (vkAllocateMemory(ctx->device, &mem_desc, NULL, &mem) != VK_SUCCESS)
-		crash("vkAllocateMemory");
-	vkBindBufferMemory(ctx->device, buf, mem, 0);
-	return (vulkan_buffer){ buf, mem, size };
+	device_allocation mem = device_alloc(ctx, &reqs, cons, MEMORY_LINEAR);
+	vkBindBufferMemory(ctx->device, buf, mem.mem, mem.offset);
+	return (vulkan_buffer){ buf, mem, size, shared };
 }
 
+vulkan_buffer buffer_create(context *ctx,
+	VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags cons)
+{
+	return buffer_create_mode(ctx, size, usage, cons, false);
+}
+
+vulkan_buffer buffer_create_shared(context *ctx,
+	VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags cons)
+{
+	return buffer_create_mode(ctx, size, usage, cons, true);
+}
+
+void buffer_destroy(context *ctx, vulkan_buffer buf)
+{
+	vkDestroyBuffer(ctx->device, buf.handle, NULL);
+	device_free(ctx, buf.mem);
+}
+
+// host visible blocks stay mapped for their whole lifetime
 void *buffer_map(context *ctx, vulkan_buffer buf)
 {
-	void *mapped;
-	vkMapMemory(ctx->device, buf.mem, 0, buf.size, 0, &mapped);
-	return mapped;
+	(void) ctx;
+	assert(buf.mem.mapped);
+	return buf.mem.mapped;
 }
 
 void buffer_unmap(context *ctx, vulkan_buffer buf)
 {
-	vkUnmapMemory(ctx->device, buf.mem);
+	(void) ctx;
+	(void) buf;
+}
+
+staging_ring staging_ring_create(context *ctx, VkDeviceSize size)
+{
+	VkDeviceSize align = MAX((VkDeviceSize) 16,
+		ctx->specs->properties.limits.optimalBufferCopyOffsetAlignment);
+	assert(size % align == 0);
+	staging_ring ring;
+	ring.buf = buffer_create(ctx,
+		size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	ring.mapped = buffer_map(ctx, ring.buf);
+	ring.align = align;
+	ring.head = 0;
+	ring.tail = 0;
+	return ring;
+}
+
+void staging_ring_destroy(context *ctx, staging_ring *ring)
+{
+	buffer_destroy(ctx, ring->buf);
+}
+
+bool staging_ring_reserve(staging_ring *ring, VkDeviceSize size,
+	VkDeviceSize *offset)
+{
+	VkDeviceSize cap = ring->buf.size;
+	VkDeviceSize pos = (ring->head + ring->align - 1) / ring->align * ring->align;
+	VkDeviceSize off = pos % cap;
+	if (off + size > cap) {
+		// never straddle the end, skip to the start
+		pos += cap - off;
+		off = 0;
+	}
+	if (pos + size - ring->tail > cap)
+		return false;
+	ring->head = pos + size;
+	*offset = off;
+	return true;
 }
 
-static void data_transfer(context *ctx, vulkan_buffer dst, vulkan_buffer src,
-	lifetime *l)
+static VkAccessFlags usage_access(VkBufferUsageFlags usage)
+{
+	VkAccessFlags access = 0;
+	if (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)
+		access |= VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+	if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
+		access |= VK_ACCESS_INDEX_READ_BIT;
+	if (usage & VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT)
+		access |= VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+	if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+		access |= VK_ACCESS_UNIFORM_READ_BIT;
+	if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)
+		access |= VK_ACCESS_SHADER_READ_BIT|VK_ACCESS_SHADER_WRITE_BIT;
+	return access;
+}
+
+static void data_transfer(context *ctx, vulkan_buffer dst,
+	vulkan_buffer src, VkDeviceSize src_offset, lifetime *l,
+	VkAccessFlags access)
 {
 	u32 icmd = lifetime_acquire(l, ctx);
 	VkCommandBuffer cmd = l->cmd[icmd];
@@ -70,28 +141,36 @@ static void data_transfer(context *ctx, vulkan_buffer dst, vulkan_buffer src,
 	};
 	vkBeginCommandBuffer(cmd, &cmd_begin);
 	VkBufferCopy copy_desc = {
-		.srcOffset = 0,
+		.srcOffset = src_offset,
 		.dstOffset = 0,
 		.size = dst.size,
 	};
 	vkCmdCopyBuffer(cmd, src.handle, dst.handle, 1, &copy_desc);
+	lifetime_hand_buffer(l, cmd, dst, access);
 	vkEndCommandBuffer(cmd);
 	lifetime_release(l, icmd);
 }
 
-vulkan_buffer data_upload(context *ctx, VkDeviceSize size, const void *data,
-	lifetime *l, VkBufferUsageFlags usage)
+static vulkan_buffer data_upload_mode(context *ctx, VkDeviceSize size,
+	const void *data, lifetime *l, VkBufferUsageFlags usage, bool shared)
 {
-	vulkan_buffer staging = buffer_create(ctx,
-		size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	memcpy(buffer_map(ctx, staging), data, size);
-	buffer_unmap(ctx, staging);
-	vulkan_buffer uploaded = buffer_create(ctx,
+	VkDeviceSize offset;
+	memcpy(lifetime_stage(l, ctx, size, &offset), data, size);
+	vulkan_buffer uploaded = buffer_create_mode(ctx,
 		size, VK_BUFFER_USAGE_TRANSFER_DST_BIT|usage,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	data_transfer(ctx, uploaded, staging, l);
-	lifetime_bind_buffer(l, staging);
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, shared);
+	data_transfer(ctx, uploaded, l->ring.buf, offset, l, usage_access(usage));
 	return uploaded;
 }
 
+vulkan_buffer data_upload(context *ctx, VkDeviceSize size, const void *data,
+	lifetime *l, VkBufferUsageFlags usage)
+{
+	return data_upload_mode(ctx, size, data, l, usage, false);
+}
+
+vulkan_buffer data_upload_shared(context *ctx, VkDeviceSize size, const void *data,
+	lifetime *l, VkBufferUsageFlags usage)
+{
+	return data_upload_mode(ctx, size, data, l, usage, true);
+}
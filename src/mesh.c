@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "mesh.h"
+#include "util.h"
+
+
+enum {
+	FORSYTH_CACHE = 32,
+	NO_VERTEX = 0xffff,
+};
+
+u32 uv_sphere_vert_size(u32 nx, u32 ny)
+{
+	u32 nvert_quads = (nx + 1) * ny;
+	u32 nvert = nvert_quads + 2 * nx;
+	return nvert * (u32) sizeof(vertex);
+}
+
+u32 uv_sphere_indx_size(u32 nx, u32 ny)
+{
+	u32 nindx = 6 * nx * (ny - 1) + 2 * 3 * nx;
+	return nindx * (u32) sizeof(u16);
+}
+
+mesh uv_sphere(u32 nx, u32 ny, float r, vertex *vert, u16 *indx)
+{
+	u32 nvert_quads = (nx + 1) * ny;
+	u32 nvert = nvert_quads + 2 * nx;
+	u32 nindx = 6 * nx * (ny - 1) + 2 * 3 * nx;
+	assert(nvert <= NO_VERTEX);
+	vertex *vcur = vert;
+	for (u32 iy = 0; iy < ny; iy++) {
+		float angley = (float) M_PI * (float) (iy + 1) / (float) (ny + 1);
+		float rsiny = r * sinf(angley);
+		float rcosy = r * cosf(angley);
+		float iy_ny = (float) (iy + 1) / (float) (ny + 1);
+		for (u32 ix = 0; ix <= nx; ix++) {
+			float anglex = 2.0f * (float) M_PI * (float) ix / (float) nx;
+			vcur->position[0] = rsiny * cosf(anglex);
+			vcur->position[1] = rsiny * sinf(anglex);
+			vcur->position[2] = rcosy;
+			vcur->uv[0] = (float) ix / (float) nx;
+			vcur->uv[1] = iy_ny;
+			vcur++;
+		}
+	}
+	for (u32 ipole = 0; ipole < nx; ipole++) {
+		vert[nvert_quads + ipole].position[0] = 0.0f;
+		vert[nvert_quads + ipole].position[1] = 0.0f;
+		vert[nvert_quads + ipole].position[2] = r;
+		vert[nvert_quads + ipole].uv[0] = ((float) ipole + 0.5f) / (float) nx;
+		vert[nvert_quads + ipole].uv[1] = 0.0f;
+		vert[nvert_quads + ipole + nx].position[0] = 0.0f;
+		vert[nvert_quads + ipole + nx].position[1] = 0.0f;
+		vert[nvert_quads + ipole + nx].position[2] = -r;
+		vert[nvert_quads + ipole + nx].uv[0] = ((float) ipole + 0.5f) / (float) nx;
+		vert[nvert_quads + ipole + nx].uv[1] = 1.0f;
+	}
+	for (vcur = vert; vcur != vert + nvert; vcur++) {
+		glm_normalize_to(vcur->position, vcur->normal);
+	}
+	u16 *icur = indx;
+	u32 ivert = 0;
+	for (u32 irow = 0; irow < ny - 1; irow++) {
+		for (u32 icol = 0; icol < nx; icol++) {
+			*icur++ = (u16) ivert;
+			*icur++ = (u16) (ivert + nx + 1);
+			*icur++ = (u16) (ivert + nx + 2);
+			*icur++ = (u16) ivert;
+			*icur++ = (u16) (ivert + nx + 2);
+			*icur++ = (u16) (ivert + 1);
+			ivert++;
+		}
+		ivert++;
+	}
+	for (u32 ipole = 0; ipole < nx; ipole++) {
+		*icur++ = (u16) (nvert_quads + ipole);
+		*icur++ = (u16) ipole;
+		*icur++ = (u16) (ipole + 1);
+		*icur++ = (u16) (nvert_quads + ipole + nx);
+		*icur++ = (u16) (nvert_quads - nx + ipole);
+		*icur++ = (u16) (nvert_quads - nx + ipole - 1);
+	}
+	return (mesh){ vert, indx, nvert, nindx };
+}
+
+// each face grid, plus room for the vertices duplicated along the seam
+static u32 cube_sphere_nvert_max(u32 n)
+{
+	return 6 * (n + 1) * (n + 1) + 6 * (n + 1);
+}
+
+u32 cube_sphere_vert_size(u32 n)
+{
+	return cube_sphere_nvert_max(n) * (u32) sizeof(vertex);
+}
+
+u32 cube_sphere_indx_size(u32 n)
+{
+	return 6 * 6 * n * n * (u32) sizeof(u16);
+}
+
+static float longitude(vec3 dir)
+{
+	float u = atan2f(dir[1], dir[0]) / (2.0f * (float) M_PI);
+	return u < 0.0f ? u + 1.0f : u;
+}
+
+// a subdivided cube pushed onto the sphere, the tangent warp keeps the
+// triangles close to the same area instead of crowding the face edges
+mesh cube_sphere(u32 n, float r, vertex *vert, u16 *indx)
+{
+	// normal, then the two tangents, u x v is the normal
+	static const float face[6][3][3] = {
+		{ { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } },
+		{ { -1, 0, 0 }, { 0, 0, 1 }, { 0, 1, 0 } },
+		{ { 0, 1, 0 }, { 0, 0, 1 }, { 1, 0, 0 } },
+		{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },
+		{ { 0, 0, 1 }, { 1, 0, 0 }, { 0, 1, 0 } },
+		{ { 0, 0, -1 }, { 0, 1, 0 }, { 1, 0, 0 } },
+	};
+	u32 nvert_max = cube_sphere_nvert_max(n);
+	assert(nvert_max <= NO_VERTEX);
+	u32 nvert = 0;
+	for (u32 iface = 0; iface < 6; iface++) {
+		for (u32 j = 0; j <= n; j++) {
+			float b = tanf((float) M_PI_4 * (2.0f * (float) j / (float) n - 1.0f));
+			for (u32 i = 0; i <= n; i++) {
+				float a = tanf((float) M_PI_4 * (2.0f * (float) i / (float) n - 1.0f));
+				vertex *v = &vert[nvert++];
+				for (u32 k = 0; k < 3; k++) {
+					v->normal[k] = face[iface][0][k]
+						+ a * face[iface][1][k]
+						+ b * face[iface][2][k];
+				}
+				glm_normalize(v->normal);
+				glm_vec3_scale(v->normal, r, v->position);
+				v->uv[0] = longitude(v->normal);
+				v->uv[1] = acosf(v->normal[2]) / (float) M_PI;
+			}
+		}
+	}
+	u16 *icur = indx;
+	for (u32 iface = 0; iface < 6; iface++) {
+		u32 base = iface * (n + 1) * (n + 1);
+		for (u32 j = 0; j < n; j++) {
+			for (u32 i = 0; i < n; i++) {
+				u32 v00 = base + j * (n + 1) + i;
+				u32 v10 = v00 + 1;
+				u32 v01 = v00 + n + 1;
+				u32 v11 = v01 + 1;
+				*icur++ = (u16) v00;
+				*icur++ = (u16) v10;
+				*icur++ = (u16) v11;
+				*icur++ = (u16) v00;
+				*icur++ = (u16) v11;
+				*icur++ = (u16) v01;
+			}
+		}
+	}
+	u32 nindx = (u32) (icur - indx);
+	// triangles across the u = 0 seam would interpolate backwards over
+	// the whole texture, their low side gets a copy shifted by one
+	u16 *wrapped = xmalloc(nvert * sizeof(u16));
+	memset(wrapped, 0xff, nvert * sizeof(u16));
+	for (u32 itri = 0; itri < nindx; itri += 3) {
+		float lo = 1.0f, hi = 0.0f;
+		for (u32 k = 0; k < 3; k++) {
+			float u = vert[indx[itri + k]].uv[0];
+			lo = MIN(lo, u);
+			hi = MAX(hi, u);
+		}
+		if (hi - lo <= 0.5f)
+			continue;
+		for (u32 k = 0; k < 3; k++) {
+			u16 iv = indx[itri + k];
+			if (vert[iv].uv[0] >= 0.5f)
+				continue;
+			if (wrapped[iv] == NO_VERTEX) {
+				if (nvert == nvert_max)
+					crash("cube_sphere: too many seam vertices");
+				vert[nvert] = vert[iv];
+				vert[nvert].uv[0] += 1.0f;
+				wrapped[iv] = (u16) nvert++;
+			}
+			indx[itri + k] = wrapped[iv];
+		}
+	}
+	free(wrapped);
+	return (mesh){ vert, indx, nvert, nindx };
+}
+
+// no vertices, impostor.vert makes the corners from the indices
+mesh impostor_quad(vertex *vert, u16 *indx)
+{
+	static const u16 corners[] = { 0, 1, 2, 2, 1, 3 };
+	memcpy(indx, corners, sizeof(corners));
+	return (mesh){ vert, indx, 0, ARRAY_SIZE(corners) };
+}
+
+// Forsyth's scoring: recently used vertices and vertices with few
+// triangles left are preferred, the last triangle's three are kept flat
+// so its order does not matter
+static float vertex_score(i32 cache_pos, u32 live)
+{
+	if (live == 0)
+		return -1.0f;
+	float score = 0.0f;
+	if (cache_pos >= 3) {
+		float s = 1.0f - (float) (cache_pos - 3) / (float) (FORSYTH_CACHE - 3);
+		score = powf(s, 1.5f);
+	} else if (cache_pos >= 0) {
+		score = 0.75f;
+	}
+	return score + 2.0f / sqrtf((float) live);
+}
+
+void mesh_optimize_cache(mesh *m)
+{
+	u32 ntri = m->nindx / 3;
+	if (ntri == 0)
+		return;
+	// triangles of each vertex, live ones first in adj[first[v]..]
+	u32 *live = xmalloc(m->nvert * sizeof(u32));
+	u32 *first = xmalloc((m->nvert + 1) * sizeof(u32));
+	u32 *adj = xmalloc(m->nindx * sizeof(u32));
+	memset(live, 0, m->nvert * sizeof(u32));
+	for (u32 i = 0; i < m->nindx; i++)
+		live[m->indx[i]]++;
+	first[0] = 0;
+	for (u32 v = 0; v < m->nvert; v++) {
+		first[v + 1] = first[v] + live[v];
+		live[v] = 0;
+	}
+	for (u32 i = 0; i < m->nindx; i++) {
+		u16 v = m->indx[i];
+		adj[first[v] + live[v]++] = i / 3;
+	}
+	i32 *cache_pos = xmalloc(m->nvert * sizeof(i32));
+	float *vscore = xmalloc(m->nvert * sizeof(float));
+	for (u32 v = 0; v < m->nvert; v++) {
+		cache_pos[v] = -1;
+		vscore[v] = vertex_score(-1, live[v]);
+	}
+	float *tscore = xmalloc(ntri * sizeof(float));
+	bool *emitted = xmalloc(ntri * sizeof(bool));
+	u32 best = 0;
+	for (u32 t = 0; t < ntri; t++) {
+		const u16 *tri = &m->indx[3 * t];
+		tscore[t] = vscore[tri[0]] + vscore[tri[1]] + vscore[tri[2]];
+		emitted[t] = false;
+		if (tscore[t] > tscore[best])
+			best = t;
+	}
+	u16 *out = xmalloc(m->nindx * sizeof(u16));
+	u16 cache[FORSYTH_CACHE + 3];
+	u32 ncache = 0;
+	for (u32 iout = 0; iout < ntri; iout++) {
+		if (best == UINT32_MAX) {
+			// nothing cached has triangles left, take the best anywhere
+			for (u32 t = 0; t < ntri; t++) {
+				if (!emitted[t] && (best == UINT32_MAX || tscore[t] > tscore[best]))
+					best = t;
+			}
+		}
+		const u16 *tri = &m->indx[3 * best];
+		memcpy(&out[3 * iout], tri, 3 * sizeof(u16));
+		emitted[best] = true;
+		for (u32 k = 0; k < 3; k++) {
+			u16 v = tri[k];
+			u32 *a = &adj[first[v]];
+			u32 at = 0;
+			while (a[at] != best)
+				at++;
+			a[at] = a[--live[v]];
+		}
+		// the triangle's vertices move to the front, the rest shift back
+		u16 next[FORSYTH_CACHE + 3];
+		u32 nnext = 0;
+		for (u32 k = 0; k < 3; k++)
+			next[nnext++] = tri[k];
+		for (u32 c = 0; c < ncache; c++) {
+			u16 v = cache[c];
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				next[nnext++] = v;
+		}
+		// the overflow past the cache just fell out of it
+		for (u32 c = 0; c < nnext; c++) {
+			u16 v = next[c];
+			cache_pos[v] = c < FORSYTH_CACHE ? (i32) c : -1;
+			vscore[v] = vertex_score(cache_pos[v], live[v]);
+		}
+		best = UINT32_MAX;
+		for (u32 c = 0; c < nnext; c++) {
+			u16 v = next[c];
+			for (u32 ia = first[v]; ia < first[v] + live[v]; ia++) {
+				u32 t = adj[ia];
+				const u16 *ttri = &m->indx[3 * t];
+				tscore[t] = vscore[ttri[0]] + vscore[ttri[1]] + vscore[ttri[2]];
+				if (best == UINT32_MAX || tscore[t] > tscore[best])
+					best = t;
+			}
+		}
+		ncache = MIN(nnext, (u32) FORSYTH_CACHE);
+		memcpy(cache, next, ncache * sizeof(u16));
+	}
+	memcpy(m->indx, out, m->nindx * sizeof(u16));
+	free(out);
+	free(emitted);
+	free(tscore);
+	free(vscore);
+	free(cache_pos);
+	free(adj);
+	free(first);
+	free(live);
+}
+
+void mesh_optimize_fetch(mesh *m)
+{
+	u16 *remap = xmalloc(m->nvert * sizeof(u16));
+	memset(remap, 0xff, m->nvert * sizeof(u16));
+	vertex *old = xmalloc(m->nvert * sizeof(vertex));
+	memcpy(old, m->vert, m->nvert * sizeof(vertex));
+	u32 nvert = 0;
+	for (u32 i = 0; i < m->nindx; i++) {
+		u16 v = m->indx[i];
+		if (remap[v] == NO_VERTEX) {
+			m->vert[nvert] = old[v];
+			remap[v] = (u16) nvert++;
+		}
+		m->indx[i] = remap[v];
+	}
+	m->nvert = nvert;
+	free(old);
+	free(remap);
+}
+
+float mesh_acmr(const mesh *m, u32 cache_size)
+{
+	if (m->nindx == 0)
+		return 0.0f;
+	// a vertex is cached while fewer than cache_size misses followed its own
+	u32 *loaded = xmalloc(m->nvert * sizeof(u32));
+	memset(loaded, 0xff, m->nvert * sizeof(u32));
+	u32 misses = 0;
+	for (u32 i = 0; i < m->nindx; i++) {
+		u16 v = m->indx[i];
+		if (loaded[v] == UINT32_MAX || misses - loaded[v] >= cache_size)
+			loaded[v] = misses++;
+	}
+	free(loaded);
+	return (float) misses / (float) (m->nindx / 3);
+}
+
+// unit normal onto the octahedron, the lower half folded over the upper
+static void oct_encode(const vec3 n, i16 dest[2])
+{
+	float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+	float x = n[0] / l1, y = n[1] / l1;
+	if (n[2] < 0.0f) {
+		float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	dest[0] = (i16) lroundf(CLAMP(x, -1.0f, 1.0f) * 32767.0f);
+	dest[1] = (i16) lroundf(CLAMP(y, -1.0f, 1.0f) * 32767.0f);
+}
+
+static u16 unorm16(float x)
+{
+	return (u16) lroundf(CLAMP(x, 0.0f, 1.0f) * 65535.0f);
+}
+
+void mesh_pack(const mesh *m, packed_vertex *dest)
+{
+	for (u32 i = 0; i < m->nvert; i++) {
+		const vertex *v = &m->vert[i];
+		oct_encode(v->normal, dest[i].normal);
+		dest[i].uv[0] = unorm16(0.5f * v->uv[0]);
+		dest[i].uv[1] = unorm16(v->uv[1]);
+	}
+}
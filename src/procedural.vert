@@ -0,0 +1,51 @@
+#version 450
+
+#include "shared.h"
+
+// uniforms
+layout(push_constant) uniform info_data {
+	push_constant_data info;
+};
+
+layout(std430, set = 0, binding = 1) readonly restrict buffer orbit_tfm {
+	instance inst[MAX_ITEMS];
+} pull;
+
+layout(std430, set = 0, binding = 2) readonly restrict buffer instance_indices {
+	uint partial[MAX_ITEMS];
+	uint imodel[MAX_ITEMS];
+};
+
+// varyings
+layout(location = 0) out vec3 vert_world_pos;
+layout(location = 1) out vec3 vert_normal;
+layout(location = 2) out vec2 vert_uv;
+layout(location = 3) out float vert_texindex;
+
+// uv_sphere without a vertex buffer: nx by ny + 1 quads between the
+// rings and the poles, 6 vertices each, in the same winding; the quads
+// touching a pole have one degenerate triangle
+const uvec2 corner[6] = uvec2[](
+	uvec2(0, 0), uvec2(0, 1), uvec2(1, 1),
+	uvec2(0, 0), uvec2(1, 1), uvec2(1, 0));
+
+void main()
+{
+	uint model = imodel[gl_InstanceIndex];
+	uint tess = info.sphere_tess[partial[model]];
+	uvec2 n = uvec2(tess & 0xffffu, (tess >> 16) + 1);
+	uint quad = uint(gl_VertexIndex) / 6u;
+	uvec2 grid = uvec2(quad % n.x, quad / n.x) + corner[uint(gl_VertexIndex) % 6u];
+	vec2 uv = vec2(grid) / vec2(n);
+	float lon = 2.0 * 3.14159265 * uv.x;
+	float lat = 3.14159265 * uv.y;
+	vec3 normal = vec3(sin(lat) * cos(lon), sin(lat) * sin(lon), cos(lat));
+
+	vert_uv = uv;
+	instance inst = pull.inst[model];
+	vert_texindex = float(inst.texindex);
+	vec4 q = instance_orient(inst);
+	vert_normal = quat_rotate(q, normal);
+	vert_world_pos = inst.pos_scale.xyz + inst.pos_scale.w * 0.5 * vert_normal;
+	gl_Position = info.viewproj * vec4(vert_world_pos, 1.0);
+}
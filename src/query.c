@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+#include "query.h"
+#include "util.h"
+
+
+static const char *PASS_NAME[PASS_COUNT] = {
+	[PASS_CLEAR]         = "clear",
+	[PASS_PROPAGATE]     = "propagate",
+	[PASS_UPDATE_MODELS] = "update_models",
+	[PASS_MAKE_DRAWS]    = "make_draws",
+	[PASS_RENDER]        = "render",
+	[PASS_PYRAMID]       = "depth_pyramid",
+};
+
+// graphics statistics cannot be queried from a compute only queue
+static bool pass_is_graphics(gpu_pass pass)
+{
+	return pass == PASS_RENDER;
+}
+
+const char *gpu_pass_name(gpu_pass pass)
+{
+	return PASS_NAME[pass];
+}
+
+static VkQueryPool query_pool_create(context *ctx, VkQueryType type,
+	VkQueryPipelineStatisticFlags stats, u32 count)
+{
+	VkQueryPoolCreateInfo pool_desc = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = type,
+		.queryCount = count,
+		.pipelineStatistics = stats,
+	};
+	VkQueryPool pool;
+	if (vkCreateQueryPool(ctx->device, &pool_desc, NULL, &pool) != VK_SUCCESS)
+		crash("vkCreateQueryPool");
+	return pool;
+}
+
+// family holds the queue families the passes are recorded on
+gpu_profiler gpu_profiler_create(context *ctx, u32 n_family, const u32 *family)
+{
+	gpu_profiler p;
+	memset(&p, 0, sizeof(p));
+	u32 valid_bits = 64;
+	for (u32 i = 0; i < n_family; i++) {
+		valid_bits = MIN(valid_bits,
+			ctx->specs->queue_families[family[i]].timestampValidBits);
+	}
+	p.timestamps = valid_bits > 0;
+	p.statistics = ctx->specs->features.pipelineStatisticsQuery;
+	p.mask = valid_bits == 64? UINT64_MAX: (1ull << valid_bits) - 1;
+	p.period_ms = (double) ctx->specs->properties.limits.timestampPeriod * 1e-6;
+	for (u32 f = 0; f < MAX_FRAMES_RENDERING; f++) {
+		if (p.timestamps) {
+			p.time[f] = query_pool_create(ctx, VK_QUERY_TYPE_TIMESTAMP,
+				0, 2 * PASS_COUNT);
+		}
+		if (p.statistics) {
+			p.compute[f] = query_pool_create(ctx,
+				VK_QUERY_TYPE_PIPELINE_STATISTICS,
+				VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT,
+				PASS_COUNT);
+			p.graphics[f] = query_pool_create(ctx,
+				VK_QUERY_TYPE_PIPELINE_STATISTICS,
+				VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT
+				| VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT,
+				PASS_COUNT);
+		}
+	}
+	return p;
+}
+
+void gpu_profiler_destroy(context *ctx, gpu_profiler *p)
+{
+	for (u32 f = 0; f < MAX_FRAMES_RENDERING; f++) {
+		if (p->timestamps) {
+			vkDestroyQueryPool(ctx->device, p->time[f], NULL);
+		}
+		if (p->statistics) {
+			vkDestroyQueryPool(ctx->device, p->compute[f], NULL);
+			vkDestroyQueryPool(ctx->device, p->graphics[f], NULL);
+		}
+	}
+}
+
+// outside of a render pass, the reset cannot be recorded in one
+void gpu_profiler_begin(gpu_profiler *p, VkCommandBuffer cmd,
+	u32 frame, gpu_pass pass)
+{
+	if (!p)
+		return;
+	if (p->timestamps) {
+		vkCmdResetQueryPool(cmd, p->time[frame], 2 * pass, 2);
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+			p->time[frame], 2 * pass);
+	}
+	if (p->statistics) {
+		VkQueryPool pool = pass_is_graphics(pass)?
+			p->graphics[frame]: p->compute[frame];
+		vkCmdResetQueryPool(cmd, pool, pass, 1);
+		vkCmdBeginQuery(cmd, pool, pass, 0);
+	}
+	p->recorded[frame] |= 1u << pass;
+}
+
+void gpu_profiler_end(gpu_profiler *p, VkCommandBuffer cmd,
+	u32 frame, gpu_pass pass)
+{
+	if (!p)
+		return;
+	if (p->statistics) {
+		vkCmdEndQuery(cmd, pass_is_graphics(pass)?
+			p->graphics[frame]: p->compute[frame], pass);
+	}
+	if (p->timestamps) {
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			p->time[frame], 2 * pass + 1);
+	}
+}
+
+// the slot's previous frame has retired when it is about to be reused,
+// results that are still not available are skipped rather than waited on
+void gpu_profiler_collect(context *ctx, gpu_profiler *p, u32 frame)
+{
+	for (u32 pass = 0; pass < PASS_COUNT; pass++) {
+		if (!(p->recorded[frame] & (1u << pass)))
+			continue;
+		u64 stamp[2];
+		if (p->timestamps && vkGetQueryPoolResults(ctx->device,
+			p->time[frame], 2 * pass, 2, sizeof(stamp), stamp,
+			sizeof(*stamp), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+			u64 ticks = (stamp[1] - stamp[0]) & p->mask;
+			p->history[pass][p->i_history[pass]] =
+				(float) ((double) ticks * p->period_ms);
+			p->i_history[pass] = (p->i_history[pass] + 1) % QUERY_HISTORY;
+			p->n_history[pass] = MIN(p->n_history[pass] + 1, (u32) QUERY_HISTORY);
+		}
+		if (!p->statistics)
+			continue;
+		u64 *inv = p->invocations[pass];
+		if (pass_is_graphics(pass)) {
+			u64 counts[2];
+			if (vkGetQueryPoolResults(ctx->device, p->graphics[frame],
+				pass, 1, sizeof(counts), counts, sizeof(counts),
+				VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+				inv[0] = counts[0];
+				inv[1] = counts[1];
+			}
+		} else {
+			u64 count;
+			if (vkGetQueryPoolResults(ctx->device, p->compute[frame],
+				pass, 1, sizeof(count), &count, sizeof(count),
+				VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+				inv[2] = count;
+			}
+		}
+	}
+	p->recorded[frame] = 0;
+}
+
+static int float_cmp(const void *_a, const void *_b)
+{
+	float a = *(const float*) _a;
+	float b = *(const float*) _b;
+	return (a > b) - (a < b);
+}
+
+gpu_pass_report gpu_profiler_report(const gpu_profiler *p, gpu_pass pass)
+{
+	gpu_pass_report r;
+	memset(&r, 0, sizeof(r));
+	r.samples = p->n_history[pass];
+	r.vertex_invocations = p->invocations[pass][0];
+	r.fragment_invocations = p->invocations[pass][1];
+	r.compute_invocations = p->invocations[pass][2];
+	if (r.samples == 0)
+		return r;
+	float sorted[QUERY_HISTORY];
+	memcpy(sorted, p->history[pass], r.samples * sizeof(float));
+	qsort(sorted, r.samples, sizeof(float), float_cmp);
+	double sum = 0.0;
+	for (u32 i = 0; i < r.samples; i++) {
+		sum += sorted[i];
+	}
+	r.mean_ms = (float) (sum / r.samples);
+	r.p50_ms = sorted[(r.samples - 1) * 50 / 100];
+	r.p95_ms = sorted[(r.samples - 1) * 95 / 100];
+	r.p99_ms = sorted[(r.samples - 1) * 99 / 100];
+	return r;
+}
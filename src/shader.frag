@@ -3,7 +3,11 @@
 #include "shared.h"
 
 // uniforms
-layout(binding = 3) uniform sampler2DArray tex;
+layout(binding = 3) uniform sampler2DArray tail;
+layout(binding = 5) uniform sampler2DArray detail;
+layout(std430, binding = 6) readonly restrict buffer residency {
+	texture_residency resident;
+};
 layout(push_constant) uniform draw_data {
 	push_constant_data draw;
 };
@@ -24,7 +28,10 @@ void main()
 	vec3 green = vec3(0.0, 1.0, 0.0);
 	frag_color = vec4(mix(red, green, draw.lod / 4.0), 1.0);
 #else
-	vec3 color = texture(tex, vec3(vert_uv, vert_texindex)).rgb;
+	uint texindex = uint(vert_texindex + 0.5);
+	vec3 color = texture_streamed(detail, tail, resident.tail_mip,
+		resident.entry[texindex], vec3(vert_uv, texindex),
+		dFdx(vert_uv), dFdy(vert_uv)).rgb;
 	vec3 source = vec3(0.0);
 	vec3 normal = normalize(vert_normal);
 	vec3 to_light = normalize(source - vert_world_pos);
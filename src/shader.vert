@@ -8,12 +8,11 @@ layout(push_constant) uniform info_data {
 };
 
 // attributes
-layout(location = 0) in vec3 attr_pos;
-layout(location = 1) in vec3 normal;
-layout(location = 2) in vec2 uv;
+layout(location = 0) in vec2 oct_normal;
+layout(location = 1) in vec2 packed_uv; // u halved, see packed_vertex
 
 layout(std430, set = 0, binding = 1) readonly restrict buffer orbit_tfm {
-	mat4 model[MAX_ITEMS];
+	instance inst[MAX_ITEMS];
 } pull;
 
 layout(std430, set = 0, binding = 2) readonly restrict buffer instance_indices {
@@ -29,18 +28,15 @@ layout(location = 3) out float vert_texindex;
 
 void main()
 {
-	vert_uv = uv;
-	mat4 model = pull.model[imodel[gl_InstanceIndex]];
-	vert_texindex = model[3].w;
-	model[0].w = 0.0;
-	model[1].w = 0.0;
-	model[2].w = 0.0;
-	model[3].w = 1.0;
-	mat3 normalmat = mat3(model);
-	normalmat = transpose(inverse(normalmat));
-	vert_normal = normalmat * normal;
-	vec3 pos = attr_pos;
-	vert_world_pos = (model * vec4(pos, 1.0)).xyz;
-	gl_Position = info.viewproj * model * vec4(pos, 1.0);
+	vec3 normal = oct_decode(oct_normal);
+	vert_uv = packed_uv * vec2(2.0, 1.0);
+	instance inst = pull.inst[imodel[gl_InstanceIndex]];
+	vert_texindex = float(inst.texindex);
+	vec4 q = instance_orient(inst);
+	// the scale is uniform so normals only need the rotation, and the
+	// position is the normal on the 0.5 radius sphere like procedural.vert
+	vert_normal = quat_rotate(q, normal);
+	vert_world_pos = inst.pos_scale.xyz + inst.pos_scale.w * 0.5 * vert_normal;
+	gl_Position = info.viewproj * vec4(vert_world_pos, 1.0);
 }
 
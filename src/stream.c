@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "stream.h"
+#include "util.h"
+#include "trace.h"
+
+
+static VkDeviceSize align_up(VkDeviceSize x, VkDeviceSize align)
+{
+	return (x + align - 1) / align * align;
+}
+
+static void stream_buffers_create(context *ctx, texture_stream *s)
+{
+	s->residency = buffer_create(ctx, sizeof(texture_residency),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	s->feedback = buffer_create(ctx,
+		MAX_FRAMES_RENDERING * MAX_TEXTURES * sizeof(u32),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	// read before the first simulation of each slot
+	u32 *needed = buffer_map(ctx, s->feedback);
+	memset(needed, 0, s->feedback.size);
+	s->texels_needed = needed;
+	s->dirty = true;
+}
+
+texture_stream texture_stream_create(context *ctx, const texture_file *f,
+	u32 tail_width, VkDeviceSize budget, VkDeviceSize upload_budget,
+	struct lifetime *l)
+{
+	TRACE_ZONE("texture_stream_create");
+	const texture_header *h = f->header;
+	if (h->n_layer > MAX_TEXTURES)
+		crash("%u textures, at most %u are streamed", h->n_layer, MAX_TEXTURES);
+	texture_stream s;
+	memset(&s, 0, sizeof(s));
+	s.file = f;
+	s.n_texture = h->n_layer;
+	while (s.tail_mip + 1 < h->n_mip
+	    && texture_file_level(f, 0, s.tail_mip)->width > tail_width) {
+		s.tail_mip++;
+	}
+	// a detail layer also holds the first level of the tail,
+	// so the trilinear filter blends into it without a seam
+	VkDeviceSize slot_size = 0;
+	for (u32 mip = 0; mip <= s.tail_mip; mip++) {
+		slot_size += texture_file_level(f, 0, mip)->size;
+	}
+	s.n_slot = (u32) MIN(budget / slot_size, (VkDeviceSize) s.n_texture);
+	if (s.n_slot == 0) {
+		printf("texture budget below a detail layer of %.1fMiB\n",
+			(double) slot_size / (1 << 20));
+		s.n_slot = 1;
+	}
+	// the only texels read at startup, the finer levels are paged in as
+	// stream_stage copies them
+	s.tail = texture_file_upload(ctx, f, s.tail_mip, l);
+	const texture_level *top = texture_file_level(f, 0, 0);
+	s.detail = vulkan_bound_image_create_layered(ctx, (VkFormat) h->format,
+		top->width, top->height, s.tail_mip + 1, s.n_slot);
+	// every frame slot copies from its own region, a single level
+	// may always be streamed whatever the budget
+	s.align = MAX((VkDeviceSize) TEXTURE_ALIGN,
+		ctx->specs->properties.limits.optimalBufferCopyOffsetAlignment);
+	s.upload_budget = upload_budget;
+	s.staging_size = align_up(MAX(upload_budget, top->size), s.align);
+	s.staging = buffer_create(ctx, MAX_FRAMES_RENDERING * s.staging_size,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	s.staged = buffer_map(ctx, s.staging);
+	stream_buffers_create(ctx, &s);
+	s.needed = xmalloc(s.n_texture * sizeof(*s.needed));
+	s.finest = xmalloc(s.n_texture * sizeof(*s.finest));
+	s.slot = xmalloc(s.n_texture * sizeof(*s.slot));
+	for (u32 t = 0; t < s.n_texture; t++) {
+		s.needed[t] = s.tail_mip;
+		s.finest[t] = s.tail_mip + 1;
+		s.slot[t] = STREAM_NONE;
+	}
+	s.owner = xmalloc(s.n_slot * sizeof(*s.owner));
+	for (u32 i = 0; i < s.n_slot; i++) {
+		s.owner[i] = STREAM_NONE;
+	}
+	// at most every level of every detail layer in a frame
+	s.max_copy = s.n_slot * (s.tail_mip + 1);
+	s.region = xmalloc(s.max_copy * sizeof(*s.region));
+	s.barrier = xmalloc(s.max_copy * sizeof(*s.barrier));
+	s.table.tail_mip = s.tail_mip;
+	for (u32 t = 0; t < s.n_texture; t++) {
+		s.table.entry[t] = s.tail_mip << 16;
+	}
+	printf("streaming %u textures into %u detail layers of %.1fMiB, tail from level %u\n",
+		s.n_texture, s.n_slot, (double) slot_size / (1 << 20), s.tail_mip);
+	return s;
+}
+
+texture_stream texture_stream_resident(context *ctx, vulkan_bound_image image)
+{
+	texture_stream s;
+	memset(&s, 0, sizeof(s));
+	s.n_texture = image.n_img;
+	s.tail = image;
+	s.detail = image;
+	stream_buffers_create(ctx, &s);
+	return s;
+}
+
+void texture_stream_destroy(context *ctx, texture_stream *s)
+{
+	buffer_destroy(ctx, s->feedback);
+	buffer_destroy(ctx, s->residency);
+	vulkan_bound_image_destroy(ctx, &s->tail);
+	if (!s->file)
+		return;
+	vulkan_bound_image_destroy(ctx, &s->detail);
+	buffer_destroy(ctx, s->staging);
+	free(s->barrier);
+	free(s->region);
+	free(s->owner);
+	free(s->slot);
+	free(s->finest);
+	free(s->needed);
+}
+
+void texture_stream_layout_init(texture_stream *s, VkCommandBuffer cmd)
+{
+	if (!s->file)
+		return;
+	vulkan_bound_image_layout_transition(cmd, &s->tail,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	// nothing samples a detail layer before it is streamed in
+	vulkan_bound_image_layout_transition(cmd, &s->detail,
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+}
+
+// the level whose width is closest above the texels asked for,
+// the tail when no body of the texture was drawn
+static u32 level_needed(const texture_stream *s, u32 texels)
+{
+	if (texels == 0)
+		return s->tail_mip;
+	u32 mip = 0;
+	while (mip < s->tail_mip
+	    && texture_file_level(s->file, 0, mip + 1)->width >= texels) {
+		mip++;
+	}
+	return mip;
+}
+
+// finest need first, each takes a free detail layer or the one of the
+// texture needing the coarsest level, when that is coarser than its own
+static void stream_assign(texture_stream *s)
+{
+	u32 order[MAX_TEXTURES];
+	for (u32 t = 0; t < s->n_texture; t++) {
+		u32 i = t;
+		while (i > 0 && s->needed[order[i - 1]] > s->needed[t]) {
+			order[i] = order[i - 1];
+			i--;
+		}
+		order[i] = t;
+	}
+	for (u32 k = 0; k < s->n_texture; k++) {
+		u32 t = order[k];
+		if (s->needed[t] >= s->tail_mip)
+			break;
+		if (s->slot[t] != STREAM_NONE)
+			continue;
+		u32 victim = STREAM_NONE;
+		u32 coarsest = s->needed[t];
+		for (u32 i = 0; i < s->n_slot; i++) {
+			u32 o = s->owner[i];
+			if (o == STREAM_NONE) {
+				victim = i;
+				break;
+			}
+			if (s->needed[o] > coarsest) {
+				coarsest = s->needed[o];
+				victim = i;
+			}
+		}
+		// the textures after this one need coarser levels still
+		if (victim == STREAM_NONE)
+			break;
+		u32 o = s->owner[victim];
+		if (o != STREAM_NONE) {
+			s->slot[o] = STREAM_NONE;
+			s->finest[o] = s->tail_mip + 1;
+		}
+		s->owner[victim] = t;
+		s->slot[t] = victim;
+	}
+}
+
+// the coarsest level missing first, across every texture, so the budget
+// sharpens the most bodies; the staged levels are recorded in region
+static u32 stream_stage(texture_stream *s, u32 frame)
+{
+	u32 n_copy = 0;
+	VkDeviceSize used = 0;
+	VkDeviceSize base = frame * s->staging_size;
+	for (;;) {
+		u32 pick = STREAM_NONE;
+		for (u32 t = 0; t < s->n_texture; t++) {
+			if (s->slot[t] == STREAM_NONE || s->finest[t] <= s->needed[t])
+				continue;
+			if (pick == STREAM_NONE || s->finest[t] > s->finest[pick]
+			    || (s->finest[t] == s->finest[pick]
+			        && s->needed[t] < s->needed[pick]))
+				pick = t;
+		}
+		if (pick == STREAM_NONE)
+			break;
+		u32 mip = s->finest[pick] - 1;
+		const texture_level *lvl = texture_file_level(s->file, pick, mip);
+		VkDeviceSize at = align_up(used, s->align);
+		if (n_copy > 0 && at + lvl->size > s->upload_budget)
+			break;
+		// on the render thread, from pages of the file that may not
+		// be resident yet: a fault here waits on the disk mid-frame
+		memcpy(s->staged + base + at,
+			(const char*) s->file->mapped + lvl->offset, lvl->size);
+		s->region[n_copy] = (VkBufferImageCopy){
+			.bufferOffset = base + at,
+			.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.imageSubresource.mipLevel = mip,
+			.imageSubresource.baseArrayLayer = s->slot[pick],
+			.imageSubresource.layerCount = 1,
+			.imageExtent = { lvl->width, lvl->height, 1 },
+		};
+		n_copy++;
+		used = at + lvl->size;
+		s->finest[pick] = mip;
+	}
+	s->uploaded += used;
+	return n_copy;
+}
+
+void texture_stream_update(texture_stream *s, VkCommandBuffer cmd, u32 frame)
+{
+	TRACE_ZONE("texture_stream_update");
+	u32 n_copy = 0;
+	if (s->file) {
+		const u32 *texels = s->texels_needed + frame * MAX_TEXTURES;
+		for (u32 t = 0; t < s->n_texture; t++) {
+			s->needed[t] = level_needed(s, texels[t]);
+		}
+		stream_assign(s);
+		n_copy = stream_stage(s, frame);
+		for (u32 t = 0; t < s->n_texture; t++) {
+			u32 entry = s->slot[t] == STREAM_NONE? s->tail_mip << 16:
+				s->slot[t] | MIN(s->finest[t], s->tail_mip) << 16;
+			if (s->table.entry[t] != entry) {
+				s->table.entry[t] = entry;
+				s->dirty = true;
+			}
+		}
+	}
+	if (n_copy == 0 && !s->dirty)
+		return;
+	// the frames before this one are done sampling what is overwritten
+	for (u32 i = 0; i < n_copy; i++) {
+		s->barrier[i] = (VkImageMemoryBarrier){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.srcAccessMask = 0,
+			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = s->detail.handle,
+			.subresourceRange = {
+				VK_IMAGE_ASPECT_COLOR_BIT,
+				s->region[i].imageSubresource.mipLevel, 1,
+				s->region[i].imageSubresource.baseArrayLayer, 1,
+			},
+		};
+	}
+	VkMemoryBarrier sampled = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+	};
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0, 1, &sampled, 0, NULL, n_copy, s->barrier);
+	if (n_copy > 0) {
+		vkCmdCopyBufferToImage(cmd, s->staging.handle, s->detail.handle,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, n_copy, s->region);
+	}
+	if (s->dirty) {
+		vkCmdUpdateBuffer(cmd, s->residency.handle, 0,
+			sizeof(s->table), &s->table);
+		s->dirty = false;
+	}
+	for (u32 i = 0; i < n_copy; i++) {
+		s->barrier[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		s->barrier[i].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		s->barrier[i].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		s->barrier[i].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+	VkMemoryBarrier streamed = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+	};
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+		0, 1, &streamed, 0, NULL, n_copy, s->barrier);
+}
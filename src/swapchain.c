@@ -4,6 +4,7 @@
 #include "util.h"
 #include "sync.h"
 #include "image.h"
+#include "trace.h"
 
 vulkan_swapchain vulkan_swapchain_create(context *ctx)
 {
@@ -81,7 +82,8 @@ static vulkan_bound_image depth_buffer_create(context *ctx, VkExtent2D dims)
 	VkFormat fmt = constrain_format(ctx->physical_device,
 		ARRAY_SIZE(candidates), candidates,
 		VK_IMAGE_TILING_OPTIMAL,
-		VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+		VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+		| VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
 	if (fmt == VK_FORMAT_UNDEFINED)
 		crash("no suitable format found for a depth buffer");
 	VkImageCreateInfo desc = {
@@ -93,7 +95,9 @@ static vulkan_bound_image depth_buffer_create(context *ctx, VkExtent2D dims)
 		.arrayLayers = 1,
 		.samples = VK_SAMPLE_COUNT_1_BIT,
 		.tiling = VK_IMAGE_TILING_OPTIMAL,
-		.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+		// sampled by downsample.comp after the render pass
+		.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+		       | VK_IMAGE_USAGE_SAMPLED_BIT,
 		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
 		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 	};
@@ -101,6 +105,59 @@ static vulkan_bound_image depth_buffer_create(context *ctx, VkExtent2D dims)
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
 }
 
+// level 0 halves the depth buffer rounding up, then each axis up to a
+// power of two: the levels halve exactly, with no odd row or column the
+// reduction would drop, and the padding reads as the far plane
+static VkExtent2D pyramid_dim(VkExtent2D dims)
+{
+	VkExtent2D d = { 1, 1 };
+	while (d.width < (dims.width + 1) / 2)
+		d.width *= 2;
+	while (d.height < (dims.height + 1) / 2)
+		d.height *= 2;
+	return d;
+}
+
+// down to 1x1
+static u32 pyramid_levels_for(VkExtent2D dims)
+{
+	VkExtent2D d = pyramid_dim(dims);
+	u32 levels = 1;
+	while (d.width > 1 || d.height > 1) {
+		d.width  = MAX(d.width  / 2, 1u);
+		d.height = MAX(d.height / 2, 1u);
+		levels++;
+	}
+	if (levels > DOWNSAMPLE_MAX_LEVELS)
+		crash("%ux%u needs %u pyramid levels", dims.width, dims.height, levels);
+	return levels;
+}
+
+static vulkan_bound_image depth_pyramid_create(context *ctx, VkExtent2D dims,
+	u32 levels, bool shared)
+{
+	VkImageCreateInfo desc = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = VK_FORMAT_R32_SFLOAT,
+		.extent = { pyramid_dim(dims).width, pyramid_dim(dims).height, 1 },
+		.mipLevels = levels,
+		.arrayLayers = MAX_FRAMES_RENDERING,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.usage = VK_IMAGE_USAGE_STORAGE_BIT
+		       | VK_IMAGE_USAGE_SAMPLED_BIT,
+		.sharingMode = (shared && ctx->n_family > 1)?
+			VK_SHARING_MODE_CONCURRENT:
+			VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = ctx->n_family,
+		.pQueueFamilyIndices = ctx->family,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+	};
+	return vulkan_bound_image_create(ctx, &desc,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+}
+
 void attachment_desc(VkFormat fmt, u32 index,
 	VkAttachmentDescription *attach, VkAttachmentReference *ref,
 	VkAttachmentLoadOp on_load, VkAttachmentStoreOp on_store,
@@ -128,8 +185,8 @@ static VkRenderPass render_pass_create(VkDevice logical, VkFormat fmt,
 		VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE,
 		VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
 	attachment_desc(depth_fmt, 1, attach, refs,
-		VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_DONT_CARE,
-		VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+		VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE,
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
 	VkSubpassDescription subpass_desc = {
 		.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
 		.colorAttachmentCount = 1,
@@ -139,9 +196,11 @@ static VkRenderPass render_pass_create(VkDevice logical, VkFormat fmt,
 	VkSubpassDependency draw_dep[] = {
 		{
 			.srcSubpass = VK_SUBPASS_EXTERNAL,
+			// the previous pyramid build must be done reading depth
 			.srcStageMask =
 				VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-				| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+				| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+				| VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 			.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
 			.dstSubpass = 0,
 			.dstStageMask =
@@ -159,6 +218,14 @@ static VkRenderPass render_pass_create(VkDevice logical, VkFormat fmt,
 			.dstStageMask = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
 			.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
 		},
+		{
+			.srcSubpass = 0,
+			.srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			.dstSubpass = VK_SUBPASS_EXTERNAL,
+			.dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+		},
 	};
 	VkRenderPassCreateInfo pass_desc = {
 		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
@@ -175,7 +242,7 @@ static VkRenderPass render_pass_create(VkDevice logical, VkFormat fmt,
 	return pass;
 }
 
-attached_swapchain attached_swapchain_create(context *ctx)
+attached_swapchain attached_swapchain_create(context *ctx, bool async_compute)
 {
 	attached_swapchain sc;
 	sc.base = vulkan_swapchain_create(ctx);
@@ -184,6 +251,12 @@ attached_swapchain attached_swapchain_create(context *ctx)
 		sc.base.fmt, sc.depth_buffer.fmt);
 	sc.framebuffer = framebuf_attach(ctx->device,
 		&sc.base, sc.pass, sc.depth_buffer.view);
+	sc.pyramid_levels = pyramid_levels_for(sc.base.dim);
+	sc.depth_pyramid = depth_pyramid_create(ctx, sc.base.dim,
+		sc.pyramid_levels, async_compute);
+	sc.pyramid_chain = downsample_chain_create(ctx,
+		&sc.depth_buffer, 0, VK_IMAGE_ASPECT_DEPTH_BIT,
+		&sc.depth_pyramid, 0, 1);
 	sc.graphics_queue = hw_queue_ref(ctx, ctx->specs->iq_graphics);
 	sc.graphics_pool = command_pool_create(ctx->device, sc.graphics_queue,
 		VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
@@ -193,8 +266,19 @@ attached_swapchain attached_swapchain_create(context *ctx)
 		MAX_FRAMES_RENDERING, sc.present_ready);
 	gpu_fence_create(ctx->device,
 		MAX_FRAMES_RENDERING, sc.render_done);
-	cpu_fence_create(ctx->device,
-		MAX_FRAMES_RENDERING, sc.rendering, VK_FENCE_CREATE_SIGNALED_BIT);
+	sc.graphics_timeline = timeline_create(ctx->device);
+	for (u32 i = 0; i < MAX_FRAMES_RENDERING; i++) {
+		sc.rendered[i] = 0;
+	}
+	sc.async_compute = async_compute;
+	if (async_compute) {
+		sc.compute_queue = hw_queue_ref(ctx, ctx->specs->iq_compute);
+		sc.compute_pool = command_pool_create(ctx->device, sc.compute_queue,
+			VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+		command_buffer_create(ctx->device, sc.compute_pool,
+			MAX_FRAMES_RENDERING, sc.compute_cmd);
+		sc.compute_timeline = timeline_create(ctx->device);
+	}
 	sc.frame_indx = 0;
 	return sc;
 }
@@ -214,16 +298,36 @@ VkSemaphore *attached_swapchain_current_render_done(attached_swapchain *sc)
 	return &sc->render_done[sc->frame_indx];
 }
 
-VkFence attached_swapchain_current_rendering(attached_swapchain *sc)
+// the slot's last graphics submission, reached at once before the first
+timeline_point attached_swapchain_current_rendered(attached_swapchain *sc)
 {
-	return sc->rendering[sc->frame_indx];
+	return (timeline_point){ sc->graphics_timeline.handle,
+		sc->rendered[sc->frame_indx] };
+}
+
+// for the graphics submission of this frame, which must signal it
+timeline_point attached_swapchain_advance_rendered(attached_swapchain *sc)
+{
+	timeline_point p = timeline_advance(&sc->graphics_timeline);
+	sc->rendered[sc->frame_indx] = p.value;
+	return p;
+}
+
+VkCommandBuffer attached_swapchain_current_compute_cmd(attached_swapchain *sc)
+{
+	assert(sc->async_compute);
+	return sc->compute_cmd[sc->frame_indx];
 }
 
 void attached_swapchain_destroy(context *ctx, attached_swapchain *sc)
 {
+	if (sc->async_compute) {
+		vkDestroyCommandPool(ctx->device, sc->compute_pool, NULL);
+		timeline_destroy(ctx->device, &sc->compute_timeline);
+	}
 	vkDestroyCommandPool(ctx->device, sc->graphics_pool, NULL);
+	timeline_destroy(ctx->device, &sc->graphics_timeline);
 	for (u32 i = 0; i < MAX_FRAMES_RENDERING; i++) {
-		vkDestroyFence(ctx->device, sc->rendering[i], NULL);
 		vkDestroySemaphore(ctx->device, sc->render_done[i], NULL);
 		vkDestroySemaphore(ctx->device, sc->present_ready[i], NULL);
 	}
@@ -232,22 +336,29 @@ void attached_swapchain_destroy(context *ctx, attached_swapchain *sc)
 	}
 	free(sc->framebuffer);
 	vkDestroyRenderPass(ctx->device, sc->pass, NULL);
+	downsample_chain_destroy(ctx, &sc->pyramid_chain);
+	vulkan_bound_image_destroy(ctx, &sc->depth_pyramid);
 	vulkan_bound_image_destroy(ctx, &sc->depth_buffer);
 	vulkan_swapchain_destroy(ctx, &sc->base);
 }
 
 void attached_swapchain_swap_buffers(context *ctx, attached_swapchain *sc)
 {
+	TRACE_ZONE("swap_buffers");
 	sc->frame_indx = (sc->frame_indx + 1) % MAX_FRAMES_RENDERING;
-	cpu_fence_wait_one(ctx->device,
-		attached_swapchain_current_rendering(sc), UINT64_MAX);
-	vkAcquireNextImageKHR(ctx->device, sc->base.handle, UINT64_MAX,
-		*attached_swapchain_current_present_ready(sc),
-		VK_NULL_HANDLE, &sc->base.i_slot);
+	timeline_wait(ctx,
+		attached_swapchain_current_rendered(sc), UINT64_MAX);
+	{
+		TRACE_ZONE("vkAcquireNextImageKHR");
+		vkAcquireNextImageKHR(ctx->device, sc->base.handle, UINT64_MAX,
+			*attached_swapchain_current_present_ready(sc),
+			VK_NULL_HANDLE, &sc->base.i_slot);
+	}
 }
 
 void attached_swapchain_present(attached_swapchain *sc)
 {
+	TRACE_ZONE("vkQueuePresentKHR");
 	VkPresentInfoKHR present_desc = {
 		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
 		.waitSemaphoreCount = 1,
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include "sync.h"
 #include "util.h"
+#include "trace.h"
 
 
 void gpu_fence_create(VkDevice device, u32 cnt, VkSemaphore *sem)
@@ -15,61 +16,110 @@ void gpu_fence_create(VkDevice device, u32 cnt, VkSemaphore *sem)
 	}
 }
 
-void cpu_fence_create(VkDevice device, u32 cnt, VkFence *fence,
-	VkFenceCreateFlags flags)
+timeline timeline_create(VkDevice device)
 {
-	VkFenceCreateInfo fence_desc = {
-		.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-		.flags = flags,
+	VkSemaphoreTypeCreateInfo type_desc = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+		.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+		.initialValue = 0,
 	};
-	for (u32 i = 0; i < cnt; i++) {
-		if (vkCreateFence(device, &fence_desc,
-			NULL, &fence[i]) != VK_SUCCESS)
-			crash("vkCreateSemaphore");
-	}
+	VkSemaphoreCreateInfo sem_desc = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = &type_desc,
+	};
+	timeline t = { VK_NULL_HANDLE, 0 };
+	if (vkCreateSemaphore(device, &sem_desc, NULL, &t.handle) != VK_SUCCESS)
+		crash("vkCreateSemaphore");
+	return t;
+}
+
+void timeline_destroy(VkDevice device, timeline *t)
+{
+	vkDestroySemaphore(device, t->handle, NULL);
+	t->handle = VK_NULL_HANDLE;
+}
+
+// for the submission about to be made, which must signal it
+timeline_point timeline_advance(timeline *t)
+{
+	return (timeline_point){ t->handle, ++t->submitted };
+}
+
+// reached once everything submitted so far is done, at once if nothing was
+timeline_point timeline_last(timeline *t)
+{
+	return (timeline_point){ t->handle, t->submitted };
 }
 
-bool cpu_fence_wait_one(VkDevice device,
-	VkFence fence, u64 timeout_ns)
+// value of the latest completed submission, without blocking
+u64 timeline_reached(context *ctx, timeline *t)
 {
-	return cpu_fence_wait_all(device, 1, &fence, timeout_ns);
+	u64 value;
+	if (ctx->get_semaphore_counter_value(ctx->device, t->handle, &value) != VK_SUCCESS)
+		crash("vkGetSemaphoreCounterValue");
+	return value;
 }
 
-bool cpu_fence_wait_all(VkDevice device,
-	u32 n_fence, VkFence *fence, u64 timeout_ns)
+// nothing to reset afterwards, the point stays reached
+bool timeline_wait(context *ctx, timeline_point p, u64 timeout_ns)
 {
-	VkResult result = vkWaitForFences(device,
-		n_fence, fence, VK_TRUE, timeout_ns);
+	TRACE_ZONE("timeline_wait");
+	VkSemaphoreWaitInfo wait_desc = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &p.handle,
+		.pValues = &p.value,
+	};
+	VkResult result = ctx->wait_semaphores(ctx->device, &wait_desc, timeout_ns);
 	if (result == VK_SUCCESS) {
-		if (vkResetFences(device, n_fence, fence) != VK_SUCCESS)
-			crash("vkResetFences");
 		return true;
 	} else if (result == VK_TIMEOUT) {
 		return false;
 	} else {
-		crash("vkWaitForFences");
+		crash("vkWaitSemaphores");
 	}
 }
 
-u32 cpu_fence_wait_any(VkDevice device,
-	u32 n_fence, VkFence *fence, u64 timeout_ns)
+void submit_wait(submit_sync *s, timeline_point p, VkPipelineStageFlags stage)
 {
-	VkResult result = vkWaitForFences(device,
-		n_fence, fence, VK_FALSE, timeout_ns);
-	if (result == VK_SUCCESS) {
-		assert(n_fence < 32);
-		u32 mask = 0;
-		for (u32 i = 0; i < n_fence; i++) {
-			if (vkGetFenceStatus(device, fence[i]) == VK_SUCCESS) {
-				vkResetFences(device, 1, &fence[i]);
-				mask |= (u32) (1ull << i);
-			}
-		}
-		return mask;
-	} else if (result == VK_TIMEOUT) {
-		return false;
-	} else {
-		crash("vkWaitForFences");
-	}
+	assert(s->n_wait < SUBMIT_MAX_SEMAPHORES);
+	s->wait[s->n_wait] = p.handle;
+	s->wait_value[s->n_wait] = p.value;
+	s->wait_stage[s->n_wait] = stage;
+	s->n_wait++;
 }
 
+void submit_signal(submit_sync *s, timeline_point p)
+{
+	assert(s->n_signal < SUBMIT_MAX_SEMAPHORES);
+	s->signal[s->n_signal] = p.handle;
+	s->signal_value[s->n_signal] = p.value;
+	s->n_signal++;
+}
+
+// binary semaphores may be mixed in, their values are ignored
+void queue_submit(VkQueue queue, u32 n_cmd, const VkCommandBuffer *cmd,
+	const submit_sync *s)
+{
+	TRACE_ZONE("vkQueueSubmit");
+	VkTimelineSemaphoreSubmitInfo values_desc = {
+		.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+		.waitSemaphoreValueCount = s->n_wait,
+		.pWaitSemaphoreValues = s->wait_value,
+		.signalSemaphoreValueCount = s->n_signal,
+		.pSignalSemaphoreValues = s->signal_value,
+	};
+	VkSubmitInfo submit_desc = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.pNext = &values_desc,
+		.waitSemaphoreCount = s->n_wait,
+		.pWaitSemaphores = s->wait,
+		.pWaitDstStageMask = s->wait_stage,
+		.commandBufferCount = n_cmd,
+		.pCommandBuffers = cmd,
+		.signalSemaphoreCount = s->n_signal,
+		.pSignalSemaphores = s->signal,
+	};
+	if (vkQueueSubmit(queue, 1, &submit_desc, VK_NULL_HANDLE) != VK_SUCCESS)
+		crash("vkQueueSubmit");
+}
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "texture.h"
+#include "util.h"
+#include "lifetime.h"
+#include "trace.h"
+
+
+// bytes of a w by h level as bin/bake writes it, 0 for another format
+static u64 level_bytes(u32 format, u32 w, u32 h)
+{
+	u32 block_dim, block_size;
+	switch (format) {
+	case VK_FORMAT_R8G8B8A8_SRGB:
+		block_dim = 1;
+		block_size = 4;
+		break;
+	case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+		block_dim = 4;
+		block_size = 8;
+		break;
+	case VK_FORMAT_BC7_SRGB_BLOCK:
+		block_dim = 4;
+		block_size = 16;
+		break;
+	default:
+		return 0;
+	}
+	return (u64) ((w + block_dim - 1) / block_dim)
+		* ((h + block_dim - 1) / block_dim) * block_size;
+}
+
+bool texture_file_open(const char *path, texture_file *dest)
+{
+	TRACE_ZONE("texture_file_open");
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return false;
+		crash("open(\"%s\")", path);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		crash("fstat(\"%s\")", path);
+	size_t size = (size_t) st.st_size;
+	if (size < sizeof(texture_header))
+		crash("%s: truncated header", path);
+	void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		crash("mmap(\"%s\")", path);
+	const texture_header *h = mapped;
+	if (h->magic != TEXTURE_MAGIC || h->version != TEXTURE_VERSION)
+		crash("%s: not a version %u texture", path, TEXTURE_VERSION);
+	if (h->width == 0 || h->height == 0 || h->n_layer == 0 || h->n_mip == 0
+	    || h->n_mip > mips_for(h->width, h->height)
+	    || level_bytes(h->format, 1, 1) == 0)
+		crash("%s: bad header", path);
+	size_t tables = sizeof(*h) + h->n_layer * sizeof(float[4])
+		+ (size_t) h->n_layer * h->n_mip * sizeof(texture_level);
+	if (size < tables)
+		crash("%s: truncated level table", path);
+	dest->mapped = mapped;
+	dest->size = size;
+	dest->header = h;
+	dest->average = (const void*) ((const char*) mapped + sizeof(*h));
+	dest->level = (const void*) (dest->average + h->n_layer);
+	// the copies trust the extents, which must match what was written
+	for (u32 i = 0; i < h->n_layer * h->n_mip; i++) {
+		const texture_level *lvl = &dest->level[i];
+		u32 mip = i % h->n_mip;
+		if (lvl->width != MAX(h->width >> mip, 1u)
+		    || lvl->height != MAX(h->height >> mip, 1u)
+		    || lvl->size != level_bytes(h->format, lvl->width, lvl->height))
+			crash("%s: level %u does not match the header", path, i);
+		if (lvl->offset % TEXTURE_ALIGN != 0 || lvl->offset > size
+		    || lvl->size > size - lvl->offset)
+			crash("%s: level %u out of bounds", path, i);
+	}
+	// kept mapped for the detail levels streamed in on demand, in any
+	// order; texture_file_upload reads ahead only the levels it copies
+	madvise(mapped, size, MADV_RANDOM);
+	return true;
+}
+
+void texture_file_close(texture_file *f)
+{
+	munmap(f->mapped, f->size);
+	f->mapped = NULL;
+}
+
+const texture_level *texture_file_level(const texture_file *f, u32 layer, u32 mip)
+{
+	return &f->level[layer * f->header->n_mip + mip];
+}
+
+// starts reading the pages of a range in, which madvise wants aligned
+static void texture_file_prefetch(const texture_file *f, u64 offset, u64 size)
+{
+	u64 page = (u64) sysconf(_SC_PAGESIZE);
+	u64 start = offset - offset % page;
+	madvise((char*) f->mapped + start, (size_t) (offset + size - start),
+		MADV_WILLNEED);
+}
+
+// a layer's levels are contiguous, a single reservation and copy each
+vulkan_bound_image texture_file_upload(context *ctx,
+	const texture_file *f, u32 first_mip, lifetime *l)
+{
+	TRACE_ZONE("texture_file_upload");
+	const texture_header *h = f->header;
+	u32 n_mip = h->n_mip - first_mip;
+	const texture_level *top = texture_file_level(f, 0, first_mip);
+	vulkan_bound_image vimg = vulkan_bound_image_create_layered(ctx,
+		(VkFormat) h->format, top->width, top->height, n_mip, h->n_layer);
+	VkCommandBufferBeginInfo cmd_begin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	};
+	u32 icmd = lifetime_acquire(l, ctx);
+	VkCommandBuffer cmd = l->cmd[icmd];
+	vkBeginCommandBuffer(cmd, &cmd_begin);
+	vulkan_bound_image_layout_transition(cmd, &vimg,
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+	// every layer's levels from first_mip on, not the finer ones
+	for (u32 layer = 0; layer < h->n_layer; layer++) {
+		const texture_level *first = texture_file_level(f, layer, first_mip);
+		const texture_level *last = texture_file_level(f, layer, h->n_mip - 1);
+		texture_file_prefetch(f, first->offset,
+			last->offset + last->size - first->offset);
+	}
+	VkBufferImageCopy *region = xmalloc(n_mip * sizeof(*region));
+	for (u32 layer = 0; layer < h->n_layer; layer++) {
+		const texture_level *first = texture_file_level(f, layer, first_mip);
+		const texture_level *last = texture_file_level(f, layer, h->n_mip - 1);
+		VkDeviceSize size = last->offset + last->size - first->offset;
+		VkDeviceSize offset;
+		void *staged = lifetime_try_stage(l, size, &offset);
+		if (!staged) {
+			// submit the layers staged so far so their space can be reclaimed
+			vkEndCommandBuffer(cmd);
+			lifetime_release(l, icmd);
+			staged = lifetime_stage(l, ctx, size, &offset);
+			icmd = lifetime_acquire(l, ctx);
+			cmd = l->cmd[icmd];
+			vkBeginCommandBuffer(cmd, &cmd_begin);
+		}
+		memcpy(staged, (const char*) f->mapped + first->offset, size);
+		for (u32 mip = 0; mip < n_mip; mip++) {
+			const texture_level *lvl = texture_file_level(f, layer, first_mip + mip);
+			region[mip] = (VkBufferImageCopy){
+				.bufferOffset = offset + lvl->offset - first->offset,
+				.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.imageSubresource.mipLevel = mip,
+				.imageSubresource.baseArrayLayer = layer,
+				.imageSubresource.layerCount = 1,
+				.imageExtent = { lvl->width, lvl->height, 1 },
+			};
+		}
+		vkCmdCopyBufferToImage(cmd, l->ring.buf.handle, vimg.handle,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, n_mip, region);
+	}
+	free(region);
+	lifetime_hand_image(l, cmd, &vimg, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_ACCESS_TRANSFER_WRITE_BIT);
+	vkEndCommandBuffer(cmd);
+	lifetime_release(l, icmd);
+	return vimg;
+}
@@ -0,0 +1,101 @@
+#include "trace.h"
+
+#ifdef GALA_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "util.h"
+
+
+typedef struct trace_ring {
+	struct trace_ring *next;
+	u32 tid;
+	u64 n_event; // ever closed, only the last TRACE_EVENTS are kept
+	struct {
+		const char *name;
+		u64 begin_ns;
+		u64 end_ns;
+	} event[TRACE_EVENTS];
+} trace_ring;
+
+// every thread's ring, linked on its first zone
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings = NULL;
+static u32 n_rings = 0;
+static _Thread_local trace_ring *ring = NULL;
+
+static u64 trace_now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (u64) t.tv_sec * 1000000000ull + (u64) t.tv_nsec;
+}
+
+static trace_ring *trace_ring_create()
+{
+	trace_ring *r = xmalloc(sizeof(*r));
+	r->n_event = 0;
+	pthread_mutex_lock(&rings_lock);
+	r->tid = n_rings++;
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	return r;
+}
+
+trace_zone trace_zone_begin(const char *name)
+{
+	return (trace_zone){ name, trace_now_ns() };
+}
+
+void trace_zone_end(trace_zone *zone)
+{
+	u64 end = trace_now_ns();
+	if (!ring)
+		ring = trace_ring_create();
+	u32 i = (u32) (ring->n_event++ % TRACE_EVENTS);
+	ring->event[i].name = zone->name;
+	ring->event[i].begin_ns = zone->begin_ns;
+	ring->event[i].end_ns = end;
+}
+
+// complete events in microseconds since the oldest one kept
+void trace_dump(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		crash("fopen(\"%s\")", path);
+	pthread_mutex_lock(&rings_lock);
+	u64 epoch = UINT64_MAX;
+	for (trace_ring *r = rings; r; r = r->next) {
+		u64 n = MIN(r->n_event, (u64) TRACE_EVENTS);
+		for (u64 i = 0; i < n; i++) {
+			epoch = MIN(epoch, r->event[i].begin_ns);
+		}
+	}
+	fprintf(f, "{\"traceEvents\":[");
+	const char *sep = "\n";
+	while (rings) {
+		trace_ring *r = rings;
+		u64 n = MIN(r->n_event, (u64) TRACE_EVENTS);
+		for (u64 i = r->n_event - n; i < r->n_event; i++) {
+			u32 e = (u32) (i % TRACE_EVENTS);
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+				"\"ts\":%.3f,\"dur\":%.3f}", sep, r->event[e].name, r->tid,
+				(double) (r->event[e].begin_ns - epoch) * 1e-3,
+				(double) (r->event[e].end_ns - r->event[e].begin_ns) * 1e-3);
+			sep = ",\n";
+		}
+		rings = r->next;
+		free(r);
+	}
+	fprintf(f, "\n]}\n");
+	n_rings = 0;
+	ring = NULL;
+	pthread_mutex_unlock(&rings_lock);
+	fclose(f);
+}
+
+#endif /* GALA_TRACE */